@@ -1,58 +1,192 @@
+#include <limits.h>
+#include <sys/wait.h>
+
 #include "webserver.h"
 
 using namespace std;
 
-WebServer::WebServer(int port, int trigger_mode, int timeoutMS, bool is_open_linger,
-                     int sqlPort, const char* sqlUser, const char* sqlPwd,
-                     const char* dbName, int connPoolNum, int threadNum,
-                     bool isOpenLog, int logLevel, int logQueSize)
-    : port_(port),
-      openLinger_(is_open_linger),
-      timeoutMS_(timeoutMS),
+const char WebServer::UPGRADE_ENV[] = "WEBSERVER_UPGRADE_FD";
+
+int WebServer::signalFd_ = -1;
+atomic<uint32_t> WebServer::pendingSignals_{0};
+
+WebServer::WebServer(const Config &config)
+    : config_(config),
+      port_(config.port),
+      openLinger_(config.isOpenLinger),
+      timeoutMS_(config.timeoutMS),
+      headerTimeoutMS_(config.headerTimeoutMS > 0 ? config.headerTimeoutMS
+                                                  : config.timeoutMS),
+      writeTimeoutMS_(config.writeTimeoutMS > 0 ? config.writeTimeoutMS
+                                                : config.timeoutMS),
       isClosed_(false),
-      timer_(new HeapTimer()),
-      threadpool_(new ThreadPool(threadNum)),
+      wakeupTsc_(0),
+      staticBundle_(config.staticBundle.enable),
+      staticMaxFileSize_(config.staticBundle.maxFileSize),
+      armedET_(config.isArmedET),
+      tcpNoDelay_(config.tcp.noDelay),
+      deferAcceptS_(config.tcp.deferAcceptS),
+      fastOpenQueue_(config.tcp.fastOpenQueue),
+      acceptBatch_(config.acceptBatch),
+      drainTimeoutMS_(config.drainTimeoutMS),
+      timer_(new QuadHeapTimer()),
       epoll_(new Epoll()) {
+    // Before the event loop allocates its connections, so they are local
+    bool isReactorPinned = Affinity::Pin(config.cpu.reactor);
     // Set the resource file directory
     srcDir_ = getcwd(nullptr, 256);
     assert(srcDir_);
     strncat(srcDir_, "/../resources/", 16);
     HttpConn::userCount = 0;
     HttpConn::srcDir = srcDir_;
+    HttpRequest::maxBodySize = config.maxBodySize;
+    Tracer::Instance()->Init(config.trace.sampleRate, config.trace.ringSize);
+    const Config::Admission &admission = config.admission;
+    Admission::Instance()->Init(
+        admission.maxConn > 0 ? min(admission.maxConn, MAX_FD) : MAX_FD,
+        admission.perIpConn, admission.targetMS, admission.intervalMS,
+        admission.retryAfterS);
+    const Config::RateLimit &rate = config.rateLimit;
+    RateLimiter::Instance()->Init(rate.requests, rate.requestBurst, rate.bytes,
+                                  rate.byteBurst);
 
-    if (isOpenLog) {
-        Log::Instance()->Init(logLevel, "./log", ".log", logQueSize);
+    InitEventMode_(config.triggerMode);
+    if (config.isOpenLog) {
+        Log::Instance()->Init(config.logLevel, "./log", ".log",
+                              config.logQueueSize);
         if (isClosed_) {
             LOG_ERROR("========== Server init error!==========");
         } else {
             LOG_INFO("========== Server init ==========");
+            LOG_INFO("Config: %s", config.path.c_str());
             LOG_INFO("Port:%d, OpenLinger: %s", port_,
-                     is_open_linger ? "true" : "false");
+                     openLinger_ ? "true" : "false");
             LOG_INFO("Listen Mode: %s, OpenConn Mode: %s",
                      (listenEvent_ & EPOLLET ? "ET" : "LT"),
-                     (connEvent_ & EPOLLET ? "ET" : "LT"));
-            LOG_INFO("LogSys level: %d", logLevel);
+                     (armedET_ ? "armed ET" :
+                      connEvent_ & EPOLLET ? "ET" : "LT"));
+            LOG_INFO("LogSys level: %d", config.logLevel);
+            LOG_INFO("Timeout idle: %dms, header: %dms, write: %dms",
+                     timeoutMS_.load(), headerTimeoutMS_.load(),
+                     writeTimeoutMS_.load());
             LOG_INFO("srcDir: %s", HttpConn::srcDir);
-            LOG_INFO("SqlConnPool num: %d, ThreadPool num: %d", connPoolNum,
-                     threadNum);
+            LOG_INFO("SqlConnPool num: %d-%d, ThreadPool num: %d",
+                     config.sql.poolNum,
+                     max(config.sql.poolNum, config.sql.poolMax),
+                     config.threadNum);
+            LOG_INFO("SqlConnPool wait: %dms, idle: %dms", config.sql.waitMS,
+                     config.sql.idleMS);
+            LOG_INFO("Register batch: %d, window: %dms",
+                     config.sql.registerBatch, config.sql.registerWindowMS);
+            LOG_INFO("UserCache size: %d, ttl: %dms", config.userCache.capacity,
+                     config.userCache.ttlMS);
+            LOG_INFO("Metrics path: %s", config.metricsPath.empty()
+                                             ? "off"
+                                             : config.metricsPath.c_str());
+            LOG_INFO("Trace sample rate: %g, ring: %d, path: %s",
+                     config.trace.sampleRate, config.trace.ringSize,
+                     config.trace.path.c_str());
+            LOG_INFO("Static bundle: %s, max file size: %d",
+                     staticBundle_ ? "true" : "false",
+                     config.staticBundle.maxFileSize);
+            LOG_INFO("Max body size: %d", config.maxBodySize);
+            LOG_INFO("TCP nodelay: %s, defer accept: %ds, fastopen queue: %d, "
+                     "accept batch: %d", tcpNoDelay_ ? "true" : "false",
+                     deferAcceptS_, fastOpenQueue_, acceptBatch_);
+            LOG_INFO("Admission max conn: %d, per ip: %d, max queue: %d, "
+                     "target: %dms, interval: %dms", admission.maxConn,
+                     admission.perIpConn, admission.maxQueue,
+                     admission.targetMS, admission.intervalMS);
+            LOG_INFO("Rate limit: %g req/s (burst %d), %g bytes/s (burst %d)",
+                     rate.requests, rate.requestBurst, rate.bytes,
+                     rate.byteBurst);
+            LOG_INFO("Drain timeout: %dms", drainTimeoutMS_);
+            LOG_INFO("Blocking pool threads: %d, max queue: %d",
+                     config.blocking.threadNum, config.blocking.maxQueue);
+            LOG_INFO("CPU reactor: %s, workers: %s, log: %s",
+                     Affinity::Format(config.cpu.reactor).c_str(),
+                     Affinity::Format(config.cpu.workers).c_str(),
+                     Affinity::Format(config.cpu.log).c_str());
+        }
+        if (!Log::Instance()->PinWriter(config.cpu.log) &&
+            !config.cpu.log.empty()) {
+            LOG_WARN("Log writer not pinned");
         }
     }
-    InitEventMode_(trigger_mode);
+    if (!isReactorPinned) {
+        LOG_WARN("Reactor not pinned");
+    }
+    CheckNuma_(config.cpu);
+    threadpool_.reset(new ThreadPool(
+        config.threadNum, config.admission.maxQueue,
+        [cores = config.cpu.workers](size_t index) {
+            StartWorker_(cores, index);
+        }));
+    if (config.blocking.threadNum > 0) {
+        blockingPool_.reset(new ThreadPool(
+            config.blocking.threadNum, config.blocking.maxQueue,
+            [](size_t index) {
+                Affinity::SetName("ws-blocking-" + to_string(index));
+            }));
+    }
+    HttpConn::isOffload = static_cast<bool>(blockingPool_);
     if (!InitSocket_()) {
         isClosed_ = true;
         LOG_ERROR("Init socket failed");
         exit(1);
     }
+    InitConfigWatch_();
     LOG_INFO("============== Create SqlConnPool =================");
-    SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName,
-                                  connPoolNum);
+    SqlConnPool::Instance()->Init("localhost", config.sql.port,
+                                  config.sql.user.c_str(),
+                                  config.sql.password.c_str(),
+                                  config.sql.database.c_str(),
+                                  config.sql.poolNum, config.sql.poolMax,
+                                  config.sql.waitMS, config.sql.idleMS);
+    RegisterBatcher::Instance()->Init(SqlConnPool::Instance(),
+                                      config.sql.registerWindowMS,
+                                      config.sql.registerBatch);
+    UserCache::Instance()->Init(config.userCache.capacity,
+                                config.userCache.ttlMS);
+    Metrics::Instance()->AddCollector(CollectMetrics_);
+    InitRoutes_(config.metricsPath, config.trace.path);
+    if (staticBundle_) {
+        BuildStatic_(srcDir_, staticMaxFileSize_);
+    }
+    sweepHook_.cb = SweepRateLimit_;
+    sweepHook_.ctx = this;
+    if (RateLimiter::Instance()->IsOpen()) {
+        timer_->add(&sweepHook_, 0);
+    }
 }
 
 void WebServer::Stop() {
-    close(listenFd_);
+    if (listenFd_ >= 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+    }
+    if (configWatchFd_ >= 0) {
+        close(configWatchFd_);
+        configWatchFd_ = -1;
+    }
     isClosed_ = true;
     free(srcDir_);
+    if (UserCache::Instance()->IsOpen()) {
+        LOG_INFO("UserCache hit: %lu, miss: %lu",
+                 UserCache::Instance()->Hits(), UserCache::Instance()->Misses());
+    }
+    RegisterBatcher::Instance()->Close();
+    SqlConnPool::Stats stats = SqlConnPool::Instance()->GetStats();
+    LOG_INFO("SqlConnPool acquired: %lu, timeouts: %lu, avg wait: %luus, "
+             "max wait: %luus, reconnects: %lu", stats.acquired, stats.timeouts,
+             stats.acquired ? stats.waitUs / stats.acquired : 0,
+             stats.maxWaitUs, stats.reconnects);
     SqlConnPool::Instance()->ClosePool();
+    LOG_INFO("Accepted: %lu, timeouts: %lu, left open: %d",
+             Metrics::Instance()->Get(Metrics::ACCEPTED),
+             Metrics::Instance()->Get(Metrics::TIMEOUTS),
+             static_cast<int>(HttpConn::userCount));
+    LOG_INFO("========== Server stop ==========");
 }
 
 WebServer::~WebServer() {
@@ -81,17 +215,58 @@ void WebServer::InitEventMode_(int trigger_mode) {
         default:
             break;
     }
+    if (armedET_) {
+        // Both directions stay armed, ownership is tracked in HttpConn
+        connEvent_ = EPOLLET | EPOLLRDHUP;
+    }
     HttpConn::isET = (connEvent_ & EPOLLET);
 }
 
 /**
- * @brief Init socket for webserver, including graceful shutdown,
- *  port reuse and other settings.
- * socket() -> setsockopt() -> bind() -> listen() -> Add listenFd to epoll
- * -> set listenFd non block (Using non block IO model)
+ * @brief Init socket for webserver: the listen socket handed over by the
+ * process being upgraded, or a new one, then the signal eventfd.
  * @return true if init socket success
  */
 bool WebServer::InitSocket_() {
+    const char *upgrade = getenv(UPGRADE_ENV);
+    if (upgrade) {
+        // Started by StartUpgrade_(), the old process sends its listen fd
+        upgradeFd_ = atoi(upgrade);
+        unsetenv(UPGRADE_ENV);
+        listenFd_ = RecvFd_(upgradeFd_);
+        if (listenFd_ < 0) {
+            LOG_ERROR("No listen socket from the previous process");
+            return false;
+        }
+        LOG_INFO("Listen socket taken over from the previous process");
+    } else if (!Listen_()) {
+        return false;
+    }
+
+    if (!epoll_->AddFd(listenFd_, listenEvent_ | EPOLLIN)) {
+        LOG_ERROR("Add listen error!");
+        close(listenFd_);
+        return false;
+    }
+
+    signalFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signalFd_ < 0 || !epoll_->AddFd(signalFd_, EPOLLIN)) {
+        LOG_ERROR("Create signal eventfd error!");
+        close(listenFd_);
+        return false;
+    }
+    LOG_INFO("Init Server socket, succuss in port[%d]", port_);
+
+    return true;
+}
+
+/**
+ * @brief Create the listen socket, including graceful shutdown,
+ *  port reuse and other settings.
+ * socket() (non block) -> setsockopt() -> bind() -> listen()
+ * @return true if listening
+ */
+bool WebServer::Listen_() {
     int ret;
     struct sockaddr_in addr;
     if (port_ > 65535 || port_ < 1024) {
@@ -104,7 +279,8 @@ bool WebServer::InitSocket_() {
     addr.sin_port = htons(port_);
     struct linger optLinger = {0};
 
-    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
     if (listenFd_ < 0) {
         LOG_ERROR("Create socket error!", port_);
         return false;
@@ -141,22 +317,13 @@ bool WebServer::InitSocket_() {
         return false;
     }
 
-    ret = listen(listenFd_, 6);
+    InitTcpOptions_();
+    ret = listen(listenFd_, SOMAXCONN);
     if (ret < 0) {
         LOG_ERROR("Listen port:%d error!", port_);
         close(listenFd_);
         return false;
     }
-
-    ret = epoll_->AddFd(listenFd_, listenEvent_ | EPOLLIN);
-    if (ret == 0) {
-        LOG_ERROR("Add listen error!");
-        close(listenFd_);
-        return false;
-    }
-    SetFdNonblock_(listenFd_);
-    LOG_INFO("Init Server socket, succuss in port[%d]", port_);
-
     return true;
 }
 
@@ -164,18 +331,38 @@ void WebServer::Run() {
     int timeMS = -1;
     if (!isClosed_) {
         LOG_INFO("========== Server start ==========");
+        if (upgradeFd_ >= 0) {
+            // Fully initialized, the old process may drain now
+            if (write(upgradeFd_, "R", 1) < 0) {
+                LOG_ERROR("Upgrade: cannot notify the old process");
+            }
+            close(upgradeFd_);
+            upgradeFd_ = -1;
+        }
     }
     while (!isClosed_) {
-        if (timeoutMS_ > 0) {
-            timeMS = timer_->GetNextTick();
+        timeMS = HandleTimeouts_();
+        if (isDraining_ && (timeMS < 0 || timeMS > DRAIN_TICK_MS)) {
+            timeMS = DRAIN_TICK_MS;
         }
         int eventCnt = epoll_->Wait(timeMS);
+        if (Tracer::Instance()->IsOpen()) {
+            wakeupTsc_ = Tracer::Now();
+        }
         for (int i = 0; i < eventCnt; i++) {
             // Deal event
             int fd = epoll_->GetEventFd(i);
             uint32_t events = epoll_->GetEvents(i);
             if (fd == listenFd_) {
                 DealListen_();
+            } else if (fd == signalFd_) {
+                DealSignals_();
+            } else if (fd == upgradeFd_) {
+                DealUpgrade_();
+            } else if (fd == configWatchFd_) {
+                DealConfigWatch_();
+            } else if (armedET_) {
+                DealEvents_(&users_[fd], events);
             } else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 CloseConn_(&users_[fd]);
             } else if (events & EPOLLIN) {
@@ -186,60 +373,483 @@ void WebServer::Run() {
                 LOG_ERROR("Unexpected event");
             }
         }
+        if (isDraining_) {
+            Drain_();
+        }
+    }
+}
+
+void WebServer::StartDrain_() {
+    if (isDraining_) {
+        return;
+    }
+    isDraining_ = true;
+    HttpConn::isDraining = true;
+    drainDeadline_ = NowMS_() + drainTimeoutMS_;
+    // Pending connections stay queued on the socket for whoever else
+    // still holds it, otherwise the kernel resets them
+    epoll_->DeleteFd(listenFd_);
+    close(listenFd_);
+    listenFd_ = -1;
+    LOG_INFO("Draining %d connections, at most %dms",
+             static_cast<int>(HttpConn::userCount), drainTimeoutMS_);
+}
+
+void WebServer::Drain_() {
+    if (HttpConn::userCount == 0 || NowMS_() >= drainDeadline_) {
+        LOG_INFO("Drain done, %d connections cut",
+                 static_cast<int>(HttpConn::userCount));
+        isClosed_ = true;
+        return;
+    }
+    for (auto &user : users_) {
+        HttpConn &client = user.second;
+        // Armed ET: a worker may own it without having marked it busy yet,
+        // and be about to read the next request. Hold it while looking.
+        if (armedET_ && !client.TryOwn()) {
+            continue;
+        }
+        int64_t deadline = client.Deadline();
+        if (deadline != HttpConn::BUSY && deadline != HttpConn::NO_DEADLINE &&
+            client.Phase() == HttpConn::IDLE_TIMEOUT) {
+            // Not owned by a worker. The EOF wakes it up and it is closed
+            // through its own event, like a peer hang up.
+            shutdown(client.GetFd(), SHUT_RDWR);
+        }
+        if (armedET_) {
+            Disown_(&client);
+        }
+    }
+}
+
+/**
+ * @brief Hot upgrade: exec a fresh copy of the binary and pass it the
+ * listen socket over a Unix socket pair (SCM_RIGHTS). Both processes accept
+ * until the new one reports it is ready, then this one drains. Connections
+ * in the accept queue are never dropped, the socket is the same.
+ */
+void WebServer::StartUpgrade_() {
+    if (isDraining_ || upgradeFd_ >= 0) {
+        LOG_WARN("Upgrade already in progress");
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOG_ERROR("Upgrade: socketpair error: %d", errno);
+        return;
+    }
+    // The child may only make async-signal-safe calls until exec, so its
+    // path and environment are prepared here. Exec the real path, not
+    // /proc/self/exe, so the process keeps its name.
+    char path[PATH_MAX];
+    ssize_t pathLen = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (pathLen <= 0) {
+        LOG_ERROR("Upgrade: cannot resolve the binary: %d", errno);
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    path[pathLen] = '\0';
+    // A deploy replaced the file, the new binary is at the same path
+    static const char DELETED[] = " (deleted)";
+    size_t deletedLen = sizeof(DELETED) - 1;
+    if (static_cast<size_t>(pathLen) > deletedLen &&
+        strcmp(path + pathLen - deletedLen, DELETED) == 0) {
+        path[pathLen - deletedLen] = '\0';
+    }
+    string env = string(UPGRADE_ENV) + "=" + to_string(sv[1]);
+    vector<char*> envp;
+    for (char **e = environ; *e; e++) {
+        envp.push_back(*e);
+    }
+    envp.push_back(&env[0]);
+    envp.push_back(nullptr);
+    char *argv[] = {program_invocation_name, nullptr};
+    int maxFd = static_cast<int>(sysconf(_SC_OPEN_MAX));
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Nothing but sv[1] survives the exec, fds opened by libraries
+        // (MySQL connections) would stay open for the new process' life
+        if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) < 0) {
+            // Before Linux 5.11
+            for (int fd = 3; fd < maxFd; fd++) {
+                if (fd != sv[1]) {
+                    close(fd);
+                }
+            }
+        }
+        fcntl(sv[1], F_SETFD, 0);  // Keep it across exec
+        execve(path, argv, envp.data());
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid < 0 || !SendFd_(sv[0], listenFd_) ||
+        !epoll_->AddFd(sv[0], EPOLLIN)) {
+        LOG_ERROR("Upgrade: cannot start the new process: %d", errno);
+        close(sv[0]);
+        return;
+    }
+    upgradeFd_ = sv[0];
+    upgradePid_ = pid;
+    LOG_INFO("Upgrade: started pid %d", pid);
+}
+
+void WebServer::DealUpgrade_() {
+    char ready = 0;
+    ssize_t len = read(upgradeFd_, &ready, 1);
+    epoll_->DeleteFd(upgradeFd_);
+    close(upgradeFd_);
+    upgradeFd_ = -1;
+    if (len == 1) {
+        LOG_INFO("Upgrade: pid %d took over", upgradePid_);
+        StartDrain_();
+    } else {
+        // EOF, it exited before it was ready
+        LOG_ERROR("Upgrade: pid %d failed, keep serving", upgradePid_);
+        waitpid(upgradePid_, nullptr, WNOHANG);
+    }
+}
+
+bool WebServer::SendFd_(int sock, int fd) {
+    char data = 'F';
+    struct iovec iov = {&data, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+int WebServer::RecvFd_(int sock) {
+    char data;
+    struct iovec iov = {&data, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
     }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
 }
 
 void WebServer::CloseConn_(HttpConn* client) {
     LOG_INFO("Client[%d] quit!", client->GetFd());
-    epoll_->DeleteFd(client->GetFd());
-    client->Close();
+    if (!armedET_) {
+        // An armed fd is never shared, close() alone drops its registration
+        epoll_->DeleteFd(client->GetFd());
+    }
+    // Once the fd is closed the loop may accept it again and Init() the
+    // connection with another address
+    in_addr_t ip = client->GetAddr().sin_addr.s_addr;
+    if (client->Close()) {
+        Admission::Instance()->Leave(ip);
+    }
+}
+
+void WebServer::SweepRateLimit_(void *server) {
+    WebServer *self = static_cast<WebServer*>(server);
+    int nextMS = RateLimiter::Instance()->Sweep(Metrics::NowUs());
+    if (nextMS > 0) {
+        self->timer_->add(&self->sweepHook_, nextMS);
+    }
 }
 
 void WebServer::AddClient_(int fd, sockaddr_in addr) {
     assert(fd > 0);
-    users_[fd].Init(fd, addr);
+    HttpConn *client = &users_[fd];
+    client->Init(fd, addr);
+    Metrics::Instance()->Inc(Metrics::ACCEPTED);
+    // The first request has to arrive within the header timeout
+    client->SetRequestStart(NowMS_());
+    ExtentTime_(client, HttpConn::HEADER_TIMEOUT);
     if (timeoutMS_ > 0) {
-        timer_->addTimer(fd, timeoutMS_,
-                    bind(&WebServer::CloseConn_, this, &users_[fd]));
+        // The hook may still be queued from the fd's previous connection
+        timer_->add(client->Timer(), QuadHeapTimer::TimeStamp(
+                                         QuadHeapTimer::MS(client->Deadline())));
     }
-    epoll_->AddFd(fd, EPOLLIN | connEvent_);
-    SetFdNonblock_(fd);
+    epoll_->AddFd(fd, armedET_ ? EPOLLIN | EPOLLOUT | connEvent_
+                               : EPOLLIN | connEvent_);
     LOG_INFO("Client[%d] in!", fd);
 }
 
 void WebServer::DealListen_() {
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    do {
-        int fd = accept(listenFd_, (struct sockaddr*)&addr, &len);
-        if (fd <= 0) {
-            // accept() on success should return nonnegative int
-            return;
-        } else if (HttpConn::userCount >= MAX_FD) {
-            LOG_WARN("Clients is full, server busy");
+    // Bounded, so a connection storm cannot starve the other events
+    for (int i = 0; i < acceptBatch_; i++) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        // Non-blocking and close-on-exec from the start, no fcntl() needed
+        int fd = accept4(listenFd_, (struct sockaddr*)&addr, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                LOG_WARN("accept error: %d", errno);
+            }
             return;
+        } else if (!Admission::Instance()->Admit(addr.sin_addr.s_addr)) {
+            LOG_WARN("Client %s over the connection cap, rejected",
+                     inet_ntoa(addr.sin_addr));
+            Metrics::Instance()->Inc(Metrics::REJECTED);
+            Metrics::Instance()->Status(503);
+            Admission::Instance()->Reject(fd);
+            close(fd);
+            continue;
         }
         AddClient_(fd, addr);
-    } while (listenEvent_ & EPOLLET);
+    }
+    if (listenEvent_ & EPOLLET) {
+        // Batch used up with connections possibly left, an ET listener
+        // only reports them again after being re-armed
+        epoll_->ModifyFd(listenFd_, listenEvent_ | EPOLLIN);
+    }
 }
 
 void WebServer::DealRead_(HttpConn *client) {
     assert(client);
-    // ExtentTime_(client);
-    threadpool_->AddTask(bind(&WebServer::OnRead_, this, client));
+    bool isNew = IsNewRequest_(client);
+    if (isNew && Admission::Instance()->IsOverloaded(Metrics::NowUs())) {
+        Shed_(client);
+        return;
+    }
+    // The worker owns the connection until it sets a new deadline
+    client->SetBusy();
+    Tracer *tracer = Tracer::Instance();
+    TraceSpan &trace = client->Trace();
+    if (tracer->IsOpen() && !trace.Active() && tracer->Sample()) {
+        trace.Begin(client->GetFd(), wakeupTsc_);
+    }
+    trace.Stamp(Tracer::ENQUEUE);
+    auto task = [this, client, queued = Metrics::NowUs()] {
+        TaskStart_(queued);
+        client->Trace().Stamp(Tracer::TASK_START);
+        OnRead_(client);
+    };
+    if (!isNew) {
+        threadpool_->AddTask(move(task));
+    } else if (!threadpool_->TryAddTask(move(task))) {
+        Shed_(client);
+    }
 }
 
 void WebServer::DealWrite_(HttpConn *client) {
     assert(client);
-    // ExtentTime_(client);
-    threadpool_->AddTask(bind(&WebServer::OnWrite_, this, client));
+    client->SetBusy();
+    threadpool_->AddTask([this, client, queued = Metrics::NowUs()] {
+        TaskStart_(queued);
+        OnWrite_(client);
+    });
 }
 
-void WebServer::ExtentTime_(HttpConn *client) {
+void WebServer::DealEvents_(HttpConn *client, uint32_t events) {
     assert(client);
-    if (timeoutMS_ > 0) {
-        timer_->adjust(client->GetFd(), timeoutMS_);
+    if (!client->Post(events)) {
+        // The owner picks them up before it lets go
+        return;
+    }
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        CloseConn_(client);
+        return;
+    }
+    bool isNew = (events & EPOLLIN) && IsNewRequest_(client);
+    if (isNew && Admission::Instance()->IsOverloaded(Metrics::NowUs())) {
+        Shed_(client);
+        return;
+    }
+    client->SetBusy();
+    Tracer *tracer = Tracer::Instance();
+    TraceSpan &trace = client->Trace();
+    if ((events & EPOLLIN) && tracer->IsOpen() && !trace.Active() &&
+        tracer->Sample()) {
+        trace.Begin(client->GetFd(), wakeupTsc_);
+    }
+    trace.Stamp(Tracer::ENQUEUE);
+    auto task = [this, client, queued = Metrics::NowUs()] {
+        TaskStart_(queued);
+        client->Trace().Stamp(Tracer::TASK_START);
+        OnEvents_(client);
+    };
+    if (!isNew) {
+        threadpool_->AddTask(move(task));
+    } else if (!threadpool_->TryAddTask(move(task))) {
+        Shed_(client);
+    }
+}
+
+bool WebServer::IsNewRequest_(HttpConn *client) {
+    // Nothing of a request read and no response pending
+    return client->ToWriteBytes() == 0 &&
+           client->ReadPhase() == HttpConn::IDLE_TIMEOUT;
+}
+
+void WebServer::Shed_(HttpConn *client) {
+    Metrics::Instance()->Inc(Metrics::SHED);
+    Metrics::Instance()->Status(503);
+    Admission::Instance()->Reject(client->GetFd());
+    CloseConn_(client);
+}
+
+void WebServer::TaskStart_(int64_t queued) {
+    int64_t now = Metrics::NowUs();
+    Metrics::Instance()->Observe(Metrics::QUEUE_WAIT, now - queued);
+    Admission::Instance()->Observe(now - queued, now);
+}
+
+/**
+ * @brief Blocking routes (MySQL behind login and register) would hold an
+ * I/O worker for as long as they wait. The parsed request stays in the
+ * connection, which stays busy (no timer closes it, no event re-arms it)
+ * while a blocking pool thread runs the handler. The response is then
+ * built and written on an I/O worker as if the handler had run there.
+ */
+bool WebServer::Offload_(HttpConn *client) {
+    Metrics *metrics = Metrics::Instance();
+    metrics->Add(Metrics::BLOCKING_QUEUED, 1);
+    bool isQueued = blockingPool_->TryAddTask(
+        [this, client, queued = Metrics::NowUs()] {
+            Metrics *metrics = Metrics::Instance();
+            int64_t start = Metrics::NowUs();
+            metrics->Add(Metrics::BLOCKING_QUEUED, -1);
+            metrics->Observe(Metrics::BLOCKING_WAIT, start - queued);
+            client->RunOffloaded();
+            metrics->Observe(Metrics::BLOCKING_RUN, Metrics::NowUs() - start);
+            Resume_(client);
+        });
+    if (isQueued) {
+        metrics->Inc(Metrics::OFFLOADED);
+        return true;
+    }
+    metrics->Add(Metrics::BLOCKING_QUEUED, -1);
+    metrics->Inc(Metrics::SHED);
+    client->RejectOffload();
+    return false;
+}
+
+void WebServer::Resume_(HttpConn *client) {
+    threadpool_->AddTask([this, client, queued = Metrics::NowUs()] {
+        TaskStart_(queued);
+        if (armedET_) {
+            OnEvents_(client);
+        } else {
+            OnProcess_(client);
+        }
+    });
+}
+
+/**
+ * @brief Timeout model: a connection is always in one phase, the phase's
+ * deadline lives in the connection and is refreshed with a single store.
+ * The heap entry is only moved when it fires before the real deadline, so
+ * busy keep-alive connections cost nothing on the request path.
+ *   HEADER: request must complete within headerTimeoutMS_ of its first byte
+ *           (not extended by trickling bytes, against slow-loris)
+ *   IDLE:   keep-alive connection waiting for the next request
+ *   WRITE:  response pending, extended on every write progress
+ *   BODY:   request body pending, extended on every read progress
+ * Must be called before the fd is re-armed.
+ */
+void WebServer::ExtentTime_(HttpConn *client, HttpConn::TIMEOUT phase) {
+    assert(client);
+    if (timeoutMS_ <= 0) {
+        // No timer runs, the phase is still kept for draining
+        client->SetDeadline(HttpConn::NEVER, phase);
+        return;
+    }
+    int64_t now = NowMS_();
+    int64_t deadline = now;
+    switch (phase) {
+        case HttpConn::HEADER_TIMEOUT:
+            if (client->Phase() != HttpConn::HEADER_TIMEOUT) {
+                client->SetRequestStart(now);
+            }
+            deadline = client->RequestStart() + headerTimeoutMS_;
+            break;
+        case HttpConn::IDLE_TIMEOUT:
+            deadline = now + timeoutMS_;
+            break;
+        case HttpConn::WRITE_TIMEOUT:
+            deadline = now + writeTimeoutMS_;
+            break;
+        case HttpConn::BODY_TIMEOUT:
+            deadline = now + timeoutMS_;
+            break;
+    }
+    client->SetDeadline(deadline, phase);
+}
+
+int WebServer::HandleTimeouts_() {
+    static const char *PHASE[] = {"header", "idle", "write", "body"};
+    timer_->PopExpired(expired_);
+    int64_t now = NowMS_();
+    for (TimerHook *hook : expired_) {
+        if (hook->cb) {
+            hook->cb(hook->ctx);
+            continue;
+        }
+        HttpConn *client = static_cast<HttpConn*>(hook->ctx);
+        int64_t deadline = client->Deadline();
+        if (deadline == HttpConn::NO_DEADLINE) {
+            // Connection already closed, drop its timer
+            continue;
+        } else if (deadline == HttpConn::BUSY) {
+            // A worker owns it, look again after the shortest timeout
+            timer_->add(hook, RecheckMS_());
+        } else if (deadline > now) {
+            // Refreshed since it was queued
+            timer_->add(hook, QuadHeapTimer::TimeStamp(
+                                  QuadHeapTimer::MS(deadline)));
+        } else if (armedET_ && !client->TryOwn()) {
+            // A worker took it over before marking it busy
+            timer_->add(hook, RecheckMS_());
+        } else if (armedET_ && (deadline = client->Deadline()) > now) {
+            // Its worker made progress, stored a fresh deadline and let go
+            // between the read above and TryOwn()
+            timer_->add(hook, QuadHeapTimer::TimeStamp(
+                                  QuadHeapTimer::MS(deadline)));
+            Disown_(client);
+        } else {
+            LOG_INFO("Client[%d] %s timeout", client->GetFd(),
+                     PHASE[client->Phase()]);
+            Metrics::Instance()->Inc(Metrics::TIMEOUTS);
+            CloseConn_(client);
+        }
+    }
+    return timer_->NextTickMS();
+}
+
+void WebServer::Disown_(HttpConn *client) {
+    if (client->Release()) {
+        return;
     }
+    // DealEvents_() left them to the owner, which was the loop
+    client->SetBusy();
+    threadpool_->AddTask([this, client, queued = Metrics::NowUs()] {
+        TaskStart_(queued);
+        OnEvents_(client);
+    });
+}
+
+int WebServer::RecheckMS_() const {
+    return max(1, min({timeoutMS_.load(), headerTimeoutMS_.load(),
+                       writeTimeoutMS_.load()}));
 }
 
 void WebServer::OnRead_(HttpConn *client) {
@@ -254,11 +864,43 @@ void WebServer::OnRead_(HttpConn *client) {
 }
 
 void WebServer::OnProcess_(HttpConn *client) {
-    if (client->Handle()) {
-        epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLOUT);
-    } else {
-        epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLIN);
+    while (true) {
+        if (!client->Handle()) {
+            if (!client->IsOffloaded()) {
+                break;
+            }
+            if (Offload_(client)) {
+                // The blocking pool resumes it, hands off
+                return;
+            }
+            // Pool full, the next Handle() builds a 503
+            continue;
+        }
+        // The socket is almost always writable, only wait for EPOLLOUT
+        // when it is not
+        int writeErrno = 0;
+        ssize_t ret = client->write(&writeErrno);
+        if (client->ToWriteBytes() > 0) {
+            if (ret <= 0 && writeErrno != EAGAIN) {
+                CloseConn_(client);
+                return;
+            }
+            Metrics::Instance()->Inc(Metrics::WRITE_DEFERRED);
+            ExtentTime_(client, HttpConn::WRITE_TIMEOUT);
+            epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLOUT);
+            return;
+        }
+        Metrics::Instance()->Inc(Metrics::WRITE_DIRECT);
+        if (!client->IsKeepAlive()) {
+            CloseConn_(client);
+            return;
+        }
+        // Pipelined requests may already be buffered
     }
+    // Partial headers keep their deadline, a body in flight or an idle
+    // connection get a fresh one
+    ExtentTime_(client, client->ReadPhase());
+    epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLIN);
 }
 
 void WebServer::OnWrite_(HttpConn* client) {
@@ -271,16 +913,361 @@ void WebServer::OnWrite_(HttpConn* client) {
             OnProcess_(client);
             return;
         }
-    } else if (ret < 0) {
-        if (writeErrno == EAGAIN) {
-            // Continue transfer
-            epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLOUT);
+    } else if (ret > 0 || writeErrno == EAGAIN) {
+        // Continue transfer: socket full, or LT mode stopped early
+        ExtentTime_(client, HttpConn::WRITE_TIMEOUT);
+        epoll_->ModifyFd(client->GetFd(), connEvent_ | EPOLLOUT);
+        return;
+    }
+    CloseConn_(client);
+}
+
+void WebServer::OnEvents_(HttpConn *client) {
+    while (true) {
+        if (client->TakeEvents() & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            CloseConn_(client);
+            return;
+        }
+        if (!Drive_(client) || client->Release()) {
             return;
         }
+        // Events came in while parking, keep going with a busy deadline
+        client->SetBusy();
     }
-    CloseConn_(client);
 }
 
-int WebServer::SetFdNonblock_(int fd) {
-    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFD, 0) | O_NONBLOCK);
+bool WebServer::Drive_(HttpConn *client) {
+    bool isBuilt = false;  // Response built and not yet written to
+    while (true) {
+        int saveErrno = 0;
+        if (client->ToWriteBytes() > 0) {
+            if (!client->CanWrite()) {
+                if (isBuilt) {
+                    Metrics::Instance()->Inc(Metrics::WRITE_DEFERRED);
+                }
+                ExtentTime_(client, HttpConn::WRITE_TIMEOUT);
+                return true;
+            }
+            ssize_t ret = client->write(&saveErrno);
+            if (ret <= 0 && saveErrno != EAGAIN) {
+                CloseConn_(client);
+                return false;
+            }
+            if (isBuilt) {
+                Metrics::Instance()->Inc(client->ToWriteBytes() == 0
+                                             ? Metrics::WRITE_DIRECT
+                                             : Metrics::WRITE_DEFERRED);
+                isBuilt = false;
+            }
+            if (client->ToWriteBytes() == 0 && !client->IsKeepAlive()) {
+                CloseConn_(client);
+                return false;
+            }
+        } else if (client->Handle()) {
+            isBuilt = true;
+        } else if (client->IsOffloaded()) {
+            if (Offload_(client)) {
+                // Still owned, the blocking pool resumes it
+                return false;
+            }
+        } else {
+            if (!client->CanRead()) {
+                ExtentTime_(client, client->ReadPhase());
+                return true;
+            }
+            ssize_t ret = client->read(&saveErrno);
+            if (ret <= 0 && saveErrno != EAGAIN) {
+                CloseConn_(client);
+                return false;
+            }
+        }
+    }
+}
+
+void WebServer::Notify(int signo) {
+    int saveErrno = errno;
+    pendingSignals_.fetch_or(1u << signo);
+    uint64_t one = 1;
+    if (signalFd_ >= 0 && write(signalFd_, &one, sizeof(one)) < 0) {
+        // Counter already pending, the loop wakes up anyway
+    }
+    errno = saveErrno;
+}
+
+void WebServer::DealSignals_() {
+    uint64_t count;
+    while (read(signalFd_, &count, sizeof(count)) > 0) {
+    }
+    uint32_t signals = pendingSignals_.exchange(0);
+    if (signals & ((1u << SIGINT) | (1u << SIGTERM))) {
+        StartDrain_();
+    }
+    if (signals & (1u << SIGUSR2)) {
+        StartUpgrade_();
+    }
+    if (signals & (1u << SIGHUP)) {
+        ReloadConfig_();
+    }
+    if (signals & (1u << SIGUSR1)) {
+        if (staticBundle_) {
+            ReloadStatic_();
+        } else {
+            LOG_WARN("SIGUSR1 ignored, static bundle is off");
+        }
+    }
+}
+
+void WebServer::ReloadStatic_() {
+    threadpool_->AddTask([srcDir = string(srcDir_),
+                          size = staticMaxFileSize_] {
+        BuildStatic_(srcDir, size);
+    });
+}
+
+void WebServer::BuildStatic_(const string &srcDir, size_t maxFileSize) {
+    auto bundle = StaticBundle::Build(srcDir, maxFileSize);
+    if (!bundle) {
+        LOG_ERROR("Static bundle build failed, keep serving the old one");
+        return;
+    }
+    LOG_INFO("Static bundle: %lu files, %lu bytes, huge pages: %s",
+             bundle->Size(), bundle->Bytes(),
+             bundle->IsHugePage() ? "true" : "false");
+    StaticBundle::Swap(move(bundle));
+}
+
+void WebServer::InitConfigWatch_() {
+    if (config_.path.empty()) {
+        return;
+    }
+    size_t slash = config_.path.rfind('/');
+    string dir = slash == string::npos ? "." : config_.path.substr(0, slash + 1);
+    configWatchFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (configWatchFd_ < 0 ||
+        inotify_add_watch(configWatchFd_, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        !epoll_->AddFd(configWatchFd_, EPOLLIN)) {
+        LOG_WARN("Config file not watched, reload with SIGHUP: %d", errno);
+        if (configWatchFd_ >= 0) {
+            close(configWatchFd_);
+            configWatchFd_ = -1;
+        }
+    }
+}
+
+void WebServer::DealConfigWatch_() {
+    string name = config_.path.substr(config_.path.rfind('/') + 1);
+    alignas(struct inotify_event) char buf[4096];
+    bool isChanged = false;
+    ssize_t len;
+    // One reload for all events of a save, editors write in several steps
+    while ((len = read(configWatchFd_, buf, sizeof(buf))) > 0) {
+        for (char *pos = buf; pos < buf + len;) {
+            struct inotify_event *event =
+                reinterpret_cast<struct inotify_event*>(pos);
+            if (event->len && name == event->name) {
+                isChanged = true;
+            }
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (isChanged) {
+        LOG_INFO("Config file %s changed", config_.path.c_str());
+        ReloadConfig_();
+    }
+}
+
+/**
+ * @brief Reload the config file, on SIGHUP or when it changes. A file that
+ * fails validation changes nothing. Otherwise log level, timeouts (from a
+ * connection's next phase on), pool and cache sizes, admission and rate
+ * limits, body size and the static bundle take effect at once; keys that
+ * need a restart are reported and keep their running value.
+ */
+void WebServer::ReloadConfig_() {
+    Config next;
+    string error;
+    if (!Config::Load(config_.path, next, error)) {
+        LOG_ERROR("Config reload rejected: %s", error.c_str());
+        return;
+    }
+    for (const string &key : Config::KeepRestartOnly(config_, next)) {
+        LOG_WARN("Config reload: \"%s\" changed but needs a restart, "
+                 "not applied", key.c_str());
+    }
+    Log::Instance()->SetLevel(next.logLevel);
+    timeoutMS_ = next.timeoutMS;
+    headerTimeoutMS_ = next.headerTimeoutMS > 0 ? next.headerTimeoutMS
+                                                : next.timeoutMS;
+    writeTimeoutMS_ = next.writeTimeoutMS > 0 ? next.writeTimeoutMS
+                                              : next.timeoutMS;
+    drainTimeoutMS_ = next.drainTimeoutMS;
+    acceptBatch_ = next.acceptBatch;
+    HttpRequest::maxBodySize = next.maxBodySize;
+
+    threadpool_->Resize(next.threadNum);
+    threadpool_->SetMaxTasks(next.admission.maxQueue);
+    if (blockingPool_) {
+        blockingPool_->Resize(next.blocking.threadNum);
+        blockingPool_->SetMaxTasks(next.blocking.maxQueue);
+    }
+    SqlConnPool::Instance()->Resize(next.sql.poolNum, next.sql.poolMax,
+                                    next.sql.waitMS, next.sql.idleMS);
+    UserCache::Instance()->Set(next.userCache.capacity, next.userCache.ttlMS);
+
+    const Config::Admission &admission = next.admission;
+    Admission::Instance()->Init(
+        admission.maxConn > 0 ? min(admission.maxConn, MAX_FD) : MAX_FD,
+        admission.perIpConn, admission.targetMS, admission.intervalMS,
+        admission.retryAfterS);
+    const Config::RateLimit &rate = next.rateLimit;
+    RateLimiter::Instance()->Set(rate.requests, rate.requestBurst, rate.bytes,
+                                 rate.byteBurst);
+    if (RateLimiter::Instance()->IsOpen() && !sweepHook_.linked()) {
+        timer_->add(&sweepHook_, 0);
+    }
+
+    if (next.staticBundle.enable != config_.staticBundle.enable ||
+        next.staticBundle.maxFileSize != config_.staticBundle.maxFileSize) {
+        staticBundle_ = next.staticBundle.enable;
+        staticMaxFileSize_ = next.staticBundle.maxFileSize;
+        if (staticBundle_) {
+            ReloadStatic_();
+        } else {
+            StaticBundle::Swap(nullptr);
+        }
+    }
+    config_ = move(next);
+    LOG_INFO("Config reloaded: log level %d, timeout idle %dms, header %dms, "
+             "write %dms, threads %d, max queue %d, sql pool %d-%d",
+             config_.logLevel, timeoutMS_.load(), headerTimeoutMS_.load(),
+             writeTimeoutMS_.load(), config_.threadNum,
+             config_.admission.maxQueue, config_.sql.poolNum,
+             max(config_.sql.poolNum, config_.sql.poolMax));
+    LOG_INFO("Config reloaded: user cache %d (ttl %dms), rate limit %g req/s, "
+             "%g bytes/s, max conn %d (per ip %d), max body %d",
+             config_.userCache.capacity, config_.userCache.ttlMS,
+             config_.rateLimit.requests, config_.rateLimit.bytes,
+             config_.admission.maxConn, config_.admission.perIpConn,
+             config_.maxBodySize);
+}
+
+void WebServer::InitRoutes_(const string &metricsPath,
+                            const string &tracePath) {
+    Router *router = Router::Instance();
+    router->Clear();
+    router->Alias("/", "/index.html");
+    for (const char *page : {"/index", "/register", "/login", "/welcome",
+                             "/video", "/picture"}) {
+        router->Alias(page, string(page) + ".html");
+    }
+    auto user = [](bool isLogin) {
+        return [isLogin](const HttpRequest &request, const Router::Params&,
+                         Router::Reply &reply) {
+            bool ok = HttpRequest::UserVerify(
+                request.GetPostValueByKey("username"),
+                request.GetPostValueByKey("password"), isLogin);
+            reply.path = ok ? "/welcome.html" : "/error.html";
+        };
+    };
+    router->Add(Router::POST, "/login", user(true), true);
+    router->Add(Router::POST, "/register", user(false), true);
+
+    if (!metricsPath.empty()) {
+        router->Add(Router::GET, metricsPath,
+                    [](const HttpRequest&, const Router::Params&,
+                       Router::Reply &reply) {
+            reply.type = "text/plain; version=0.0.4";
+            reply.body = Metrics::Instance()->Render();
+        });
+    }
+    if (!tracePath.empty() && Tracer::Instance()->IsOpen()) {
+        // Can be megabytes, streamed instead of rendered at once
+        router->Add(Router::GET, tracePath,
+                    [](const HttpRequest&, const Router::Params&,
+                       Router::Reply &reply) {
+            reply.type = "application/json";
+            reply.stream = Tracer::Instance()->DumpStream();
+        });
+    }
+}
+
+void WebServer::CollectMetrics_(string &out) {
+    SqlConnPool::Stats stats = SqlConnPool::Instance()->GetStats();
+    out += "# TYPE webserver_connections gauge\n";
+    out += "webserver_connections " + to_string(HttpConn::userCount) + "\n";
+    out += "# TYPE webserver_db_connections gauge\n";
+    out += "webserver_db_connections{state=\"total\"} " +
+           to_string(stats.total) + "\n";
+    out += "webserver_db_connections{state=\"idle\"} " +
+           to_string(stats.idle) + "\n";
+    out += "# TYPE webserver_db_wait_timeouts_total counter\n";
+    out += "webserver_db_wait_timeouts_total " + to_string(stats.timeouts) +
+           "\n";
+    out += "# TYPE webserver_db_reconnects_total counter\n";
+    out += "webserver_db_reconnects_total " + to_string(stats.reconnects) +
+           "\n";
+    if (RateLimiter::Instance()->IsOpen()) {
+        out += "# TYPE webserver_rate_limit_clients gauge\n";
+        out += "webserver_rate_limit_clients " +
+               to_string(RateLimiter::Instance()->Size()) + "\n";
+    }
+    if (UserCache::Instance()->IsOpen()) {
+        out += "# TYPE webserver_user_cache_lookups_total counter\n";
+        out += "webserver_user_cache_lookups_total{result=\"hit\"} " +
+               to_string(UserCache::Instance()->Hits()) + "\n";
+        out += "webserver_user_cache_lookups_total{result=\"miss\"} " +
+               to_string(UserCache::Instance()->Misses()) + "\n";
+    }
+}
+
+void WebServer::StartWorker_(const vector<int> &cores, size_t index) {
+    Affinity::SetName("ws-worker-" + to_string(index));
+    // Before the worker touches its stack and trace ring
+    if (!cores.empty() && !Affinity::Pin({cores[index % cores.size()]})) {
+        LOG_WARN("Worker %lu not pinned to CPU %d", index,
+                 cores[index % cores.size()]);
+    }
+}
+
+void WebServer::CheckNuma_(const Config::Cpu &cpu) {
+    if (cpu.reactor.empty() || cpu.workers.empty()) {
+        return;
+    }
+    // The reactor allocates connections, the workers use them
+    set<int> nodes;
+    for (const vector<int> *cores : {&cpu.reactor, &cpu.workers}) {
+        for (int core : *cores) {
+            nodes.insert(Affinity::NodeOf(core));
+        }
+    }
+    if (nodes.size() > 1) {
+        LOG_WARN("Reactor and workers span %lu NUMA nodes, connection "
+                 "buffers are remote to some threads", nodes.size());
+    }
+}
+
+int64_t WebServer::NowMS_() {
+    return chrono::duration_cast<QuadHeapTimer::MS>(
+        QuadHeapTimer::Clock::now().time_since_epoch()).count();
+}
+
+void WebServer::InitTcpOptions_() {
+    // Accepted sockets inherit TCP_NODELAY from the listener on Linux,
+    // which saves a setsockopt() per connection
+    int on = tcpNoDelay_;
+    if (setsockopt(listenFd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        LOG_WARN("TCP_NODELAY not set: %d", errno);
+    }
+    if (deferAcceptS_ > 0 &&
+        setsockopt(listenFd_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAcceptS_,
+                   sizeof(deferAcceptS_)) < 0) {
+        LOG_WARN("TCP_DEFER_ACCEPT not set: %d", errno);
+    }
+    if (fastOpenQueue_ > 0 &&
+        setsockopt(listenFd_, IPPROTO_TCP, TCP_FASTOPEN, &fastOpenQueue_,
+                   sizeof(fastOpenQueue_)) < 0) {
+        // Also needs net.ipv4.tcp_fastopen & 2 for servers
+        LOG_WARN("TCP_FASTOPEN not set: %d", errno);
+    }
 }
@@ -0,0 +1,94 @@
+#include <sys/socket.h>
+
+#include "admission.h"
+
+using namespace std;
+
+Admission *Admission::Instance() {
+    static Admission admission;
+    return &admission;
+}
+
+void Admission::Init(int maxConn, int perIpConn, int targetMS, int intervalMS,
+                     int retryAfterS) {
+    maxConn_ = maxConn;
+    if (perIpConn <= 0 && perIpConn_ > 0) {
+        // Counting stops, a later cap starts from the connections after it
+        lock_guard<mutex> locker(mtx_);
+        perIp_.clear();
+    }
+    perIpConn_ = perIpConn;
+    targetUs_ = targetMS > 0 ? targetMS * 1000LL : 0;
+    intervalUs_ = intervalMS > 0 ? intervalMS * 1000LL : 100000;
+    reply_ = "HTTP/1.1 503 Service Unavailable\r\n";
+    if (retryAfterS > 0) {
+        reply_ += "Retry-After: " + to_string(retryAfterS) + "\r\n";
+    }
+    reply_ += "Connection: close\r\nContent-length: 0\r\n\r\n";
+}
+
+bool Admission::Admit(in_addr_t ip) {
+    if (maxConn_ > 0 && conns_.load(memory_order_relaxed) >= maxConn_) {
+        return false;
+    }
+    if (perIpConn_ > 0) {
+        lock_guard<mutex> locker(mtx_);
+        int &count = perIp_[ip];
+        if (count >= perIpConn_) {
+            return false;
+        }
+        count++;
+    }
+    conns_.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+void Admission::Leave(in_addr_t ip) {
+    conns_.fetch_sub(1, memory_order_relaxed);
+    if (perIpConn_ > 0) {
+        lock_guard<mutex> locker(mtx_);
+        auto it = perIp_.find(ip);
+        if (it != perIp_.end() && --it->second <= 0) {
+            perIp_.erase(it);
+        }
+    }
+}
+
+void Admission::Observe(int64_t sojournUs, int64_t nowUs) {
+    if (targetUs_ <= 0) {
+        return;
+    }
+    lastObserve_.store(nowUs, memory_order_relaxed);
+    if (sojournUs < targetUs_) {
+        // One fast task is enough, a good queue drains now and then
+        firstAbove_.store(0, memory_order_relaxed);
+        isDropping_.store(false, memory_order_relaxed);
+        return;
+    }
+    int64_t first = firstAbove_.load(memory_order_relaxed);
+    if (first == 0) {
+        firstAbove_.store(nowUs + intervalUs_, memory_order_relaxed);
+    } else if (nowUs >= first) {
+        isDropping_.store(true, memory_order_relaxed);
+    }
+}
+
+bool Admission::IsOverloaded(int64_t nowUs) const {
+    // Shedding empties the queue, so without fresh samples the state is
+    // stale and requests are let through to measure again
+    return isDropping_.load(memory_order_relaxed) &&
+           nowUs - lastObserve_.load(memory_order_relaxed) < intervalUs_;
+}
+
+void Admission::Reject(int fd) const {
+    // Read what already arrived, closing with unread data sends a RST that
+    // may discard the reply before the client sees it
+    char buf[4096];
+    for (int i = 0; i < 16 && recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0;
+         i++) {
+    }
+    if (send(fd, reply_.data(), reply_.size(), MSG_DONTWAIT | MSG_NOSIGNAL)
+        < 0) {
+        // Socket full or gone, it is closed either way
+    }
+}
@@ -0,0 +1,313 @@
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <unordered_set>
+
+#include <unistd.h>
+
+#include "config.h"
+#include "affinity.h"
+#include "json.hpp"
+
+using namespace std;
+using namespace nlohmann;
+
+namespace {
+
+/**
+ * @brief Reads the keys of one JSON object. Only the first error is kept,
+ * later reads do nothing once there is one.
+ */
+class Reader {
+public:
+    Reader(const json &object, const string &name, string &error)
+        : object_(object), name_(name), error_(error) {
+        if (error_.empty() && !object_.is_object()) {
+            error_ = (name_.empty() ? string("config") : name_) +
+                     ": must be an object";
+        }
+    }
+
+    Reader Section(const char *key) {
+        static const json EMPTY = json::object();
+        const json *value = Find_(key);
+        return Reader(value ? *value : EMPTY, Name_(key), error_);
+    }
+
+    void Int(const char *key, int &value, int low=INT_MIN, int high=INT_MAX) {
+        const json *item = Find_(key);
+        if (!item) {
+            return;
+        }
+        if (!item->is_number_integer() || item->get<int64_t>() < low ||
+            item->get<int64_t>() > high) {
+            Fail_(key, "must be an integer in [" + to_string(low) + ", " +
+                       to_string(high) + "]");
+            return;
+        }
+        value = item->get<int>();
+    }
+
+    void Double(const char *key, double &value, double low, double high) {
+        const json *item = Find_(key);
+        if (!item) {
+            return;
+        }
+        if (!item->is_number() || item->get<double>() < low ||
+            item->get<double>() > high) {
+            char range[64];
+            snprintf(range, sizeof(range), "[%g, %g]", low, high);
+            Fail_(key, string("must be a number in ") + range);
+            return;
+        }
+        value = item->get<double>();
+    }
+
+    void Bool(const char *key, bool &value) {
+        const json *item = Find_(key);
+        if (!item) {
+            return;
+        }
+        if (!item->is_boolean()) {
+            Fail_(key, "must be true or false");
+            return;
+        }
+        value = item->get<bool>();
+    }
+
+    void String(const char *key, string &value) {
+        const json *item = Find_(key);
+        if (!item) {
+            return;
+        }
+        if (!item->is_string()) {
+            Fail_(key, "must be a string");
+            return;
+        }
+        value = item->get<string>();
+    }
+
+    // A URL path, empty turns the endpoint off
+    void Path(const char *key, string &value) {
+        String(key, value);
+        if (error_.empty() && !value.empty() && value[0] != '/') {
+            Fail_(key, "must be empty or start with '/'");
+        }
+    }
+
+    // Cores as for taskset -c, empty for none
+    void Cores(const char *key, vector<int> &cores) {
+        string list;
+        String(key, list);
+        if (!error_.empty()) {
+            return;
+        }
+        if (!Affinity::Parse(list, cores)) {
+            Fail_(key, "must be a CPU list like \"0-3,8\"");
+            return;
+        }
+        long cpuNum = sysconf(_SC_NPROCESSORS_CONF);
+        for (int core : cores) {
+            if (core >= cpuNum || core >= CPU_SETSIZE) {
+                Fail_(key, "has CPU " + to_string(core) + ", there are " +
+                           to_string(cpuNum));
+                return;
+            }
+        }
+    }
+
+    // Typos would silently fall back to defaults, so they are errors
+    void Done() {
+        if (!error_.empty()) {
+            return;
+        }
+        for (auto &item : object_.items()) {
+            if (!seen_.count(item.key())) {
+                Fail_(item.key().c_str(), "unknown key");
+                return;
+            }
+        }
+    }
+
+private:
+    const json *Find_(const char *key) {
+        seen_.insert(key);
+        auto it = object_.find(key);
+        if (!error_.empty() || it == object_.end()) {
+            return nullptr;
+        }
+        return &*it;
+    }
+
+    string Name_(const char *key) const {
+        return name_.empty() ? string(key) : name_ + "." + key;
+    }
+
+    void Fail_(const char *key, const string &what) {
+        error_ = "\"" + Name_(key) + "\" " + what;
+    }
+
+    const json &object_;
+    string name_;
+    string &error_;
+    unordered_set<string> seen_;
+};
+
+}  // namespace
+
+/**
+ * @brief Load and validate a config file
+ *
+ * @param path JSON file, all keys optional
+ * @param config Filled in only on success
+ * @param error Why the file was rejected
+ */
+bool Config::Load(const string &path, Config &config, string &error) {
+    ifstream file(path);
+    if (!file) {
+        error = path + ": cannot open";
+        return false;
+    }
+    json j = json::parse(file, nullptr, false);
+    if (j.is_discarded()) {
+        error = path + ": not valid JSON";
+        return false;
+    }
+    error.clear();
+    Config c;
+    c.path = path;
+    Reader root(j, "", error);
+    root.Int("Port", c.port, 1024, 65535);
+    root.Int("Trigger mode", c.triggerMode, 0, 3);
+    root.Bool("Armed ET", c.isArmedET);
+    root.Bool("Is open linger", c.isOpenLinger);
+    root.Int("Timeout MS", c.timeoutMS);
+    root.Int("Header timeout MS", c.headerTimeoutMS);
+    root.Int("Write timeout MS", c.writeTimeoutMS);
+    root.Int("Drain timeout ms", c.drainTimeoutMS, 0);
+    root.Int("Max body size", c.maxBodySize, 0);
+    root.Int("Thread num", c.threadNum, 0, 1024);
+    root.Int("Accept batch", c.acceptBatch, 1, 65536);
+    root.Bool("Is open log", c.isOpenLog);
+    root.Int("Log level", c.logLevel, 0, 3);
+    root.Int("Log queue size", c.logQueueSize, 1);
+    root.Path("Metrics path", c.metricsPath);
+
+    Reader sql = root.Section("Sql");
+    sql.Int("port", c.sql.port, 1, 65535);
+    sql.String("user", c.sql.user);
+    sql.String("password", c.sql.password);
+    sql.String("database name", c.sql.database);
+    sql.Int("connection pool num", c.sql.poolNum, 1, 1024);
+    sql.Int("connection pool max", c.sql.poolMax, 0, 1024);
+    sql.Int("wait timeout ms", c.sql.waitMS, 0);
+    sql.Int("idle timeout ms", c.sql.idleMS);
+    sql.Int("register window ms", c.sql.registerWindowMS, 0);
+    sql.Int("register batch", c.sql.registerBatch, 1, 4096);
+    sql.Done();
+
+    Reader cache = root.Section("User cache");
+    cache.Int("capacity", c.userCache.capacity, 0);
+    cache.Int("ttl ms", c.userCache.ttlMS);
+    cache.Done();
+
+    Reader trace = root.Section("Trace");
+    trace.Double("sample rate", c.trace.sampleRate, 0, 1);
+    trace.Int("ring size", c.trace.ringSize, 0);
+    trace.Path("path", c.trace.path);
+    trace.Done();
+
+    Reader bundle = root.Section("Static bundle");
+    bundle.Bool("enable", c.staticBundle.enable);
+    bundle.Int("max file size", c.staticBundle.maxFileSize, 0);
+    bundle.Done();
+
+    Reader tcp = root.Section("TCP");
+    tcp.Bool("nodelay", c.tcp.noDelay);
+    tcp.Int("defer accept s", c.tcp.deferAcceptS, 0);
+    tcp.Int("fastopen queue", c.tcp.fastOpenQueue, 0);
+    tcp.Done();
+
+    Reader admission = root.Section("Admission");
+    admission.Int("max connections", c.admission.maxConn, 0);
+    admission.Int("per ip connections", c.admission.perIpConn, 0);
+    admission.Int("max queue", c.admission.maxQueue, 0);
+    admission.Int("target ms", c.admission.targetMS, 0);
+    admission.Int("interval ms", c.admission.intervalMS, 0);
+    admission.Int("retry after s", c.admission.retryAfterS, 0);
+    admission.Done();
+
+    Reader rate = root.Section("Rate limit");
+    rate.Double("requests per s", c.rateLimit.requests, 0, 1e9);
+    rate.Int("request burst", c.rateLimit.requestBurst, 1);
+    rate.Double("bytes per s", c.rateLimit.bytes, 0, 1e15);
+    rate.Int("byte burst", c.rateLimit.byteBurst, 0);
+    rate.Done();
+
+    Reader blocking = root.Section("Blocking pool");
+    blocking.Int("threads", c.blocking.threadNum, 0, 1024);
+    blocking.Int("max queue", c.blocking.maxQueue, 0);
+    blocking.Done();
+
+    Reader cpu = root.Section("CPU affinity");
+    cpu.Cores("reactor", c.cpu.reactor);
+    cpu.Cores("workers", c.cpu.workers);
+    cpu.Cores("log", c.cpu.log);
+    cpu.Done();
+    root.Done();
+
+    if (!error.empty()) {
+        error = path + ": " + error;
+        return false;
+    }
+    config = move(c);
+    return true;
+}
+
+#define RESTART_ONLY(field, key)        \
+    if (running.field != next.field) {  \
+        keys.push_back(key);            \
+        next.field = running.field;     \
+    }
+
+vector<string> Config::KeepRestartOnly(const Config &running, Config &next) {
+    vector<string> keys;
+    // Sockets, the event loop and routes are set up once
+    RESTART_ONLY(port, "Port");
+    RESTART_ONLY(triggerMode, "Trigger mode");
+    RESTART_ONLY(isArmedET, "Armed ET");
+    RESTART_ONLY(isOpenLinger, "Is open linger");
+    RESTART_ONLY(tcp.noDelay, "TCP.nodelay");
+    RESTART_ONLY(tcp.deferAcceptS, "TCP.defer accept s");
+    RESTART_ONLY(tcp.fastOpenQueue, "TCP.fastopen queue");
+    RESTART_ONLY(isOpenLog, "Is open log");
+    RESTART_ONLY(logQueueSize, "Log queue size");
+    RESTART_ONLY(metricsPath, "Metrics path");
+    RESTART_ONLY(trace.sampleRate, "Trace.sample rate");
+    RESTART_ONLY(trace.ringSize, "Trace.ring size");
+    RESTART_ONLY(trace.path, "Trace.path");
+    // Threads are placed as they start
+    RESTART_ONLY(cpu.reactor, "CPU affinity.reactor");
+    RESTART_ONLY(cpu.workers, "CPU affinity.workers");
+    RESTART_ONLY(cpu.log, "CPU affinity.log");
+    // Open connections keep their credentials, the batcher its thread
+    RESTART_ONLY(sql.port, "Sql.port");
+    RESTART_ONLY(sql.user, "Sql.user");
+    RESTART_ONLY(sql.password, "Sql.password");
+    RESTART_ONLY(sql.database, "Sql.database name");
+    RESTART_ONLY(sql.registerWindowMS, "Sql.register window ms");
+    RESTART_ONLY(sql.registerBatch, "Sql.register batch");
+    // Running connections have timers only if timeouts were on at accept
+    if ((running.timeoutMS > 0) != (next.timeoutMS > 0)) {
+        keys.push_back("Timeout MS (turning timeouts on or off)");
+        next.timeoutMS = running.timeoutMS;
+    }
+    // Without threads there is no blocking pool to resize
+    if ((running.blocking.threadNum > 0) != (next.blocking.threadNum > 0)) {
+        keys.push_back("Blocking pool.threads (turning the pool on or off)");
+        next.blocking.threadNum = running.blocking.threadNum;
+    }
+    return keys;
+}
+
+#undef RESTART_ONLY
@@ -0,0 +1,134 @@
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "encoding.h"
+
+using namespace std;
+
+namespace {
+
+bool Gzip(const char *data, size_t len, string &out, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15 window bits + 16 for the gzip wrapper
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, len));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = len;
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+bool Brotli(const char *data, size_t len, string &out, int quality) {
+    size_t outLen = BrotliEncoderMaxCompressedSize(len);
+    if (outLen == 0) {
+        return false;
+    }
+    out.resize(outLen);
+    if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_TEXT, len,
+                               reinterpret_cast<const uint8_t*>(data), &outLen,
+                               reinterpret_cast<uint8_t*>(&out[0]))) {
+        return false;
+    }
+    out.resize(outLen);
+    return true;
+}
+
+// Trim spaces and tabs around [begin, end)
+void Trim(const string &s, size_t &begin, size_t &end) {
+    while (begin < end && (s[begin] == ' ' || s[begin] == '\t')) {
+        begin++;
+    }
+    while (end > begin && (s[end - 1] == ' ' || s[end - 1] == '\t')) {
+        end--;
+    }
+}
+
+}  // namespace
+
+Encoding::TYPE Encoding::Negotiate(const string &acceptEncoding,
+                                   unsigned available) {
+    TYPE best = IDENTITY;
+    double bestQ = 0;
+    size_t pos = 0;
+    while (pos < acceptEncoding.size()) {
+        size_t end = acceptEncoding.find(',', pos);
+        if (end == string::npos) {
+            end = acceptEncoding.size();
+        }
+        // token [; q=value]
+        size_t tokenEnd = acceptEncoding.find(';', pos);
+        if (tokenEnd == string::npos || tokenEnd > end) {
+            tokenEnd = end;
+        }
+        double q = 1;
+        size_t qPos = acceptEncoding.find("q=", tokenEnd);
+        if (qPos < end) {
+            q = atof(acceptEncoding.c_str() + qPos + 2);
+        }
+        size_t begin = pos;
+        Trim(acceptEncoding, begin, tokenEnd);
+        string token = acceptEncoding.substr(begin, tokenEnd - begin);
+        pos = end + 1;
+
+        TYPE type;
+        if (strcasecmp(token.c_str(), "br") == 0) {
+            type = BROTLI;
+        } else if (strcasecmp(token.c_str(), "gzip") == 0 ||
+                   strcasecmp(token.c_str(), "x-gzip") == 0) {
+            type = GZIP;
+        } else {
+            continue;
+        }
+        if (q <= 0 || !(available & (1u << type))) {
+            continue;
+        }
+        if (q > bestQ || (q == bestQ && type == BROTLI)) {
+            best = type;
+            bestQ = q;
+        }
+    }
+    return best;
+}
+
+const char *Encoding::Name(TYPE type) {
+    static const char *NAME[] = {"identity", "gzip", "br"};
+    return NAME[type];
+}
+
+const char *Encoding::Suffix(TYPE type) {
+    static const char *SUFFIX[] = {"", ".gz", ".br"};
+    return SUFFIX[type];
+}
+
+bool Encoding::IsCompressible(const string &contentType) {
+    return contentType.compare(0, 5, "text/") == 0 ||
+           contentType.find("javascript") != string::npos ||
+           contentType.find("json") != string::npos ||
+           contentType.find("xml") != string::npos ||
+           contentType.find("svg") != string::npos;
+}
+
+bool Encoding::Compress(TYPE type, const char *data, size_t len, string &out,
+                        bool best) {
+    switch (type) {
+        case GZIP:
+            return Gzip(data, len, out, best ? 9 : 6);
+        case BROTLI:
+            return Brotli(data, len, out, best ? BROTLI_MAX_QUALITY : 5);
+        default:
+            out.assign(data, len);
+            return true;
+    }
+}
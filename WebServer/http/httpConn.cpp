@@ -1,3 +1,5 @@
+#include <cassert>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/uio.h>
@@ -9,11 +11,17 @@ using namespace std;
 const char* HttpConn::srcDir;
 atomic<int> HttpConn::userCount;
 bool HttpConn::isET;
+bool HttpConn::isOffload;
+atomic<bool> HttpConn::isDraining{false};
 
 HttpConn::HttpConn() {
     fd_ = -1;
     addr_ = {0};
     isClose_ = true;
+    timer_.ctx = this;
+    request_.SetHeaderCallback([this](HttpRequest &request) {
+        OnHeader_(request);
+    });
 }
 
 HttpConn::~HttpConn() {
@@ -30,20 +38,43 @@ void HttpConn::Init(int fd, const sockaddr_in& addr) {
     fd_ = fd;
     writeBuff_.InitPtr();
     readBuff_.InitPtr();
+    request_.Init();
+    isKeepAlive_ = false;
+    owned_ = false;
+    pending_ = 0;
+    canRead_ = false;
+    canWrite_ = true;
+    iov_.clear();
+    iovIdx_ = 0;
+    toWrite_ = 0;
+    bytes_ = 0;
+    offload_ = OFFLOAD_NONE;
     isClose_ = false;
     LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), GetPort(),
              (int)userCount);
 }
 
-void HttpConn::Close() {
+bool HttpConn::Close() {
+    deadline_.store(NO_DEADLINE, memory_order_release);
+    SetIdle_(false);
+    writeStart_ = 0;
+    trace_.End();
+    bundle_.reset();
+    response_.CancelStream();
     response_.UnmapFile();
+    upload_ = Router::Upload();
     if (isClose_ == false) {
         isClose_ = true;
         userCount--;
-        close(fd_);
+        RateLimiter::Instance()->Charge(addr_.sin_addr.s_addr, bytes_,
+                                        Metrics::NowUs());
+        // After close() the fd and this connection may be reused at once
         LOG_INFO("Client[%d](%s:%d) quit, UserCount:%d", fd_, GetIP(),
                  GetPort(), (int)userCount);
+        close(fd_);
+        return true;
     }
+    return false;
 }
 
 int HttpConn::GetFd() const {
@@ -69,7 +100,12 @@ ssize_t HttpConn::read(int* saveErrno) {
         if (len <= 0) {
             break;
         }
-    } while (isET); // ETԵҪѭ
+        Metrics::Instance()->Inc(Metrics::BYTES_IN, len);
+        bytes_ += len;
+    } while (isET && readBuff_.ReadableBytes() < READ_LIMIT); // ETԵҪѭ
+    if (len < 0 && *saveErrno == EAGAIN) {
+        canRead_ = false;
+    }
     return len;
 }
 
@@ -77,58 +113,233 @@ ssize_t HttpConn::write(int *saveErrno) {
     // Write HTTP response line, header, body(file) to fd_
     ssize_t len = -1;
     do {
-        len = writev(fd_, iov_, iovCnt_);
+        if (toWrite_ == 0) {  // End of write
+            break;
+        }
+        len = writev(fd_, &iov_[iovIdx_],
+                     min<size_t>(iov_.size() - iovIdx_, IOV_MAX));
         if (len <= 0) {
             *saveErrno = errno;
+            if (len < 0 && errno == EAGAIN) {
+                canWrite_ = false;
+            }
             break;
         }
+        Metrics::Instance()->Inc(Metrics::BYTES_OUT, len);
+        bytes_ += len;
+        trace_.Stamp(Tracer::FIRST_BYTE);
 
-        if (iov_[0].iov_len + iov_[1].iov_len == 0) {  // End of write
-            break;
-        } else if (static_cast<size_t>(len) > iov_[0].iov_len) {
-            iov_[1].iov_base =
-                (uint8_t*)iov_[1].iov_base + (len - iov_[0].iov_len);
-            iov_[1].iov_len -= (len - iov_[0].iov_len);
-            if (iov_[0].iov_len) {
-                writeBuff_.InitPtr();
-                iov_[0].iov_len = 0;
+        // Skip what was written, iov_[0] also moves writeBuff_
+        toWrite_ -= len;
+        size_t left = len;
+        while (left > 0) {
+            struct iovec &iov = iov_[iovIdx_];
+            size_t n = min(left, iov.iov_len);
+            iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + n;
+            iov.iov_len -= n;
+            left -= n;
+            if (iovIdx_ == 0) {
+                writeBuff_.UpdateReadPtr(n);
+            }
+            if (iov.iov_len == 0) {
+                if (iovIdx_ == 0) {
+                    writeBuff_.InitPtr();
+                }
+                iovIdx_++;
             }
-        } else {
-            iov_[0].iov_base = (uint8_t*)iov_[0].iov_base + len;
-            iov_[0].iov_len -= len;
-            writeBuff_.UpdateReadPtr(len);
+        }
+        if (toWrite_ == 0) {
+            NextPiece_();
         }
     } while (isET || ToWriteBytes() > 10240); // ETģʽѭ
 
+    if (writeStart_ && ToWriteBytes() == 0) {
+        Metrics::Instance()->Observe(Metrics::WRITE,
+                                     Metrics::NowUs() - writeStart_);
+        writeStart_ = 0;
+        trace_.Stamp(Tracer::LAST_BYTE);
+        trace_.End();
+    }
     return len;
 }
 
+bool HttpConn::NextPiece_() {
+    // Everything before was written, so writeBuff_ is empty again
+    if (!response_.NextPiece(writeBuff_)) {
+        return false;
+    }
+    iov_.assign(1, {const_cast<char*>(writeBuff_.ReadPtr()),
+                    writeBuff_.ReadableBytes()});
+    iovIdx_ = 0;
+    toWrite_ = writeBuff_.ReadableBytes();
+    return true;
+}
+
 bool HttpConn::Handle() {
-    request_.Init();
+    Metrics *metrics = Metrics::Instance();
+    if (offload_ == OFFLOAD_DONE) {
+        // Back from the blocking pool, the request is still as parsed
+        offload_ = OFFLOAD_NONE;
+        Respond_(HttpRequest::GET_REQUEST, false, Router::FOUND,
+                 Metrics::NowUs());
+        return true;
+    }
     if (readBuff_.ReadableBytes() <= 0) {
         return false;
-    } else if (request_.parse(readBuff_)) {
+    }
+    int64_t start = Metrics::NowUs();
+    HttpRequest::HTTP_CODE code = request_.parse(readBuff_);
+    int64_t parseEnd = Metrics::NowUs();
+    metrics->Observe(Metrics::PARSE, parseEnd - start);
+    if (code == HttpRequest::NO_REQUEST) {
+        if (request_.TakeExpectContinue()) {
+            // Nothing else is pending on the socket while a request is read.
+            // If this does not fit, the client sends the body after its own
+            // timeout anyway.
+            static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (::write(fd_, CONTINUE, sizeof(CONTINUE) - 1) < 0) {
+                LOG_DEBUG("Client[%d] 100 Continue not sent", fd_);
+            }
+        }
+        // Wait for the rest of the request
+        return false;
+    }
+    bool parsed = code == HttpRequest::GET_REQUEST;
+    // Over its budget the client gets the prebuilt 429, nothing is routed
+    bool isLimited = parsed && !RateLimiter::Instance()->Allow(
+                                   addr_.sin_addr.s_addr, bytes_, parseEnd);
+    bytes_ = 0;
+    // The rest of a rejected request cannot be framed, close after it
+    isKeepAlive_ = parsed && request_.IsKeepAlive() && !isDraining;
+    trace_.Stamp(Tracer::PARSE_DONE);
+    trace_.SetPath(request_.path());
+    Router::RESULT routed = Router::NOT_FOUND;
+    reply_ = Router::Reply();
+    if (parsed && !isLimited) {
         LOG_DEBUG("%s", request_.path().c_str());
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
+        reply_.path = request_.path();
+        routed = Router::Instance()->Find(request_.method(), request_.path(),
+                                          route_, params_);
+        if (routed == Router::FOUND && route_->isBlocking && isOffload) {
+            // The caller hands the connection to the blocking pool
+            offload_ = OFFLOAD_PENDING;
+            return false;
+        }
+        if (routed == Router::FOUND) {
+            Run_();
+        }
+    }
+    Respond_(code, isLimited, routed, parseEnd);
+    return true;
+}
+
+void HttpConn::OnHeader_(HttpRequest &request) {
+    // Route before the body, an upload route takes it as it arrives
+    upload_ = Router::Upload();
+    const Router::Route *route;
+    if (Router::Instance()->Find(request.method(), request.path(), route,
+                                 params_) == Router::FOUND && route->upload) {
+        upload_ = route->upload(request, params_);
+        request.SetBodyCallback(move(upload_.onBody));
+    }
+}
+
+void HttpConn::Run_() {
+    if (!route_->upload) {
+        route_->handler(request_, params_, reply_);
+        return;
+    }
+    if (upload_.onDone) {
+        upload_.onDone(request_, params_, reply_);
+    }
+    upload_ = Router::Upload();
+}
+
+void HttpConn::RunOffloaded() {
+    assert(offload_ == OFFLOAD_PENDING);
+    Run_();
+    offload_ = OFFLOAD_DONE;
+}
+
+void HttpConn::RejectOffload() {
+    assert(offload_ == OFFLOAD_PENDING);
+    reply_.code = 503;
+    reply_.type = "text/plain";
+    reply_.body = "Service Unavailable\n";
+    offload_ = OFFLOAD_DONE;
+}
+
+void HttpConn::Respond_(HttpRequest::HTTP_CODE code, bool isLimited,
+                        Router::RESULT routed, int64_t start) {
+    Metrics *metrics = Metrics::Instance();
+    bool parsed = code == HttpRequest::GET_REQUEST;
+    string acceptEncoding(request_.Header(HttpRequest::ACCEPT_ENCODING));
+    bool hasRange = false;
+    Router::Reply &reply = reply_;
+    if (isLimited) {
+        response_.Init(srcDir, request_.path(), isKeepAlive_, 429);
+    } else if (parsed) {
+        response_.Init(srcDir, reply.path, isKeepAlive_,
+                       routed == Router::NOT_ALLOWED ? 405 : reply.code,
+                       acceptEncoding);
+        vector<HttpRequest::ByteRange> ranges;
+        if (request_.GetRanges(ranges)) {
+            hasRange = true;
+            response_.SetRanges(ranges, string(request_.Header(
+                                            HttpRequest::IF_RANGE)));
+        }
     } else {
-        response_.Init(srcDir, request_.path(), false, 400);
+        response_.Init(srcDir, request_.path(), false,
+                       code == HttpRequest::TOO_LARGE_REQUEST ? 413 : 400);
     }
 
-    response_.MakeResponse(writeBuff_);
+    const StaticBundle::Asset *asset = nullptr;
+    const StaticBundle::Variant *variant = nullptr;
+    if (isLimited) {
+        writeBuff_.append(RateLimiter::Instance()->Reply(isKeepAlive_));
+    } else if (!parsed || routed == Router::NOT_ALLOWED) {
+        response_.MakeResponse(writeBuff_);
+    } else if (reply.stream) {
+        bool isChunked = request_.version() == "1.1";
+        isKeepAlive_ = isKeepAlive_ && isChunked;
+        response_.MakeStream(writeBuff_, reply.type, move(reply.stream),
+                             isChunked);
+        response_.NextPiece(writeBuff_);
+    } else if (!reply.type.empty()) {
+        response_.MakeResponse(writeBuff_, reply.type, reply.body);
+    } else if (!hasRange && reply.code == -1
+               && (bundle_ = StaticBundle::Current())
+               && (asset = bundle_->Find(reply.path))) {
+        // Prebuilt headers, the body is written straight from the bundle
+        variant = &asset->Get(Encoding::Negotiate(acceptEncoding,
+                                                  asset->encodings));
+        writeBuff_.append(variant->header[isKeepAlive_],
+                          variant->headerLen[isKeepAlive_]);
+    } else {
+        response_.MakeResponse(writeBuff_);
+    }
+    writeStart_ = Metrics::NowUs();
+    metrics->Observe(Metrics::BUILD, writeStart_ - start);
+    metrics->Status(response_.Code());
+    trace_.Stamp(Tracer::RESPONSE_BUILT);
 
     // Write writeBuff_ to response
-    iov_[0].iov_base = const_cast<char*>(writeBuff_.ReadPtr());
-    iov_[0].iov_len = writeBuff_.ReadableBytes();
-    iovCnt_ = 1;
-
-    // Set response file
-    if (response_.FileLen() > 0 && response_.File()) {
-        iov_[1].iov_base = response_.File();
-        iov_[1].iov_len = response_.FileLen();
-        iovCnt_ = 2;
+    iov_.clear();
+    iovIdx_ = 0;
+    iov_.push_back({const_cast<char*>(writeBuff_.ReadPtr()),
+                    writeBuff_.ReadableBytes()});
+
+    // Set response body: a bundle variant, or the file (or its ranges)
+    if (variant && variant->bodyLen > 0) {
+        iov_.push_back({const_cast<char*>(variant->body), variant->bodyLen});
+    } else {
+        iov_.insert(iov_.end(), response_.Body().begin(),
+                    response_.Body().end());
     }
-    LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen(), iovCnt_,
+    toWrite_ = 0;
+    for (const struct iovec &iov : iov_) {
+        toWrite_ += iov.iov_len;
+    }
+    LOG_DEBUG("filesize:%lu, %lu  to %lu", response_.FileLen(), iov_.size(),
               ToWriteBytes());
-
-    return true;
 }
@@ -1,90 +1,227 @@
 #include <algorithm>
 #include <regex>
 #include <cassert>
+#include <strings.h>
 
 #include "httpRequest.h"
 #include "sqlconnpool.h"
+#include "usercache.h"
+#include "registerbatcher.h"
 #include "log.h"
 
 using namespace std;
 
-const unordered_set<string> HttpRequest::DEFAULT_HTML {
-    "/index", "/register", "/login", "/welcome", "/video", "/picture",
-};
+atomic<size_t> HttpRequest::maxBodySize{1 << 20};
 
-const unordered_map<string, int> HttpRequest::DEFAULT_HTML_TAG {
-    {"/register.html", 0},
-    {"/login.html", 1},
-};
+namespace {
+
+bool EqualsNoCase(string_view a, string_view b) {
+    return a.size() == b.size() &&
+           strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+string_view Trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+}  // namespace
 
 void HttpRequest::Init() {
     method_ = path_ = version_ = body_ = "";
     state_ = REQUEST_LINE;
-    header_.clear();
+    bodyLeft_ = bodySize_ = 0;
+    expectContinue_ = false;
+    onBody_ = nullptr;
+    headerData_.clear();
+    fieldNum_ = 0;
+    fill(known_, known_ + HEADER_NUM, -1);
     post_.clear();
 }
 
 bool HttpRequest::IsKeepAlive() const {
-    if (header_.count("Connection") == 1) {
-        return header_.find("Connection")->second
-             == "keep-alive" && version_ == "1.1";
-    }
-    return false;
+    return Header(CONNECTION) == "keep-alive" && version_ == "1.1";
 }
 
-bool HttpRequest::parse(Buffer& buff) {
+HttpRequest::HTTP_CODE HttpRequest::parse(Buffer& buff) {
     const char CRLF[] = "\r\n";
-    if (buff.ReadableBytes() <= 0) {
-        return false;
+    if (state_ == FINISH) {
+        Init();
     }
-    while (buff.ReadableBytes() && state_ != FINISH) {
-        // Find "\r\n" in request
-        const char *lineEnd = search(buff.ReadPtr(), buff.ConstWritePtr(), CRLF, CRLF + 2);
-        string line(buff.ReadPtr(), lineEnd);
+    while (state_ != FINISH) {
+        if (state_ == BODY || state_ == CHUNK_DATA) {
+            size_t len = min(bodyLeft_, buff.ReadableBytes());
+            if (len == 0) {
+                break;
+            }
+            HTTP_CODE code = AppendBody_(buff.ReadPtr(), len);
+            if (code != NO_REQUEST) {
+                return code;
+            }
+            buff.UpdateReadPtr(len);
+            bodyLeft_ -= len;
+            if (bodyLeft_ == 0) {
+                state_ = state_ == BODY ? FINISH : CHUNK_END;
+            }
+            continue;
+        }
+
+        // Everything else is line based, wait for a whole line
+        const char *lineEnd = search(buff.ReadPtr(), buff.ConstWritePtr(),
+                                     CRLF, CRLF + 2);
+        if (lineEnd == buff.ConstWritePtr()) {
+            if (buff.ReadableBytes() > MAX_LINE) {
+                LOG_WARN("Line longer than %lu", MAX_LINE);
+                return BAD_REQUEST;
+            }
+            break;
+        }
+        // Still valid after consuming, the buffer only moves on append
+        string_view line(buff.ReadPtr(), lineEnd - buff.ReadPtr());
+        buff.UpdateReadPtrUntilEnd(lineEnd + 2);
 
         switch (state_) {
         case REQUEST_LINE:
-            if (!ParseRequestLine_(line)) {
-                return false;
+            // Empty lines before a request are allowed
+            if (line.empty()) {
+                break;
+            }
+            if (!ParseRequestLine_(string(line))) {
+                return BAD_REQUEST;
             }
-            ParsePath_();
             break;
         case HEADER:
-            ParseHeader_(line);
-            if (buff.ReadableBytes() <= 2 || method_ == "GET") {
-                buff.InitPtr();
-                state_ = FINISH;
+            if (line.empty()) {
+                HTTP_CODE code = ParseFraming_();
+                if (code != NO_REQUEST) {
+                    return code;
+                }
+            } else if (!ParseHeader_(line)) {
+                return BAD_REQUEST;
             }
             break;
-        case BODY:
-            ParseBody_(line);
+        case CHUNK_SIZE:
+            if (!ParseChunkSize_(line)) {
+                return BAD_REQUEST;
+            }
             break;
-        default:
+        case CHUNK_END:
+            if (!line.empty()) {
+                return BAD_REQUEST;
+            }
+            state_ = CHUNK_SIZE;
             break;
-        }
-        if (lineEnd == buff.WritePtr() || state_ == FINISH) {
-            buff.InitPtr();
+        case TRAILER:
+            // Trailer fields are ignored
+            if (line.empty()) {
+                state_ = FINISH;
+            }
+            break;
+        default:
             break;
         }
-        buff.UpdateReadPtrUntilEnd(lineEnd + 2);
+    }
+    if (buff.ReadableBytes() == 0) {
+        buff.InitPtr();
+    }
+    if (state_ != FINISH) {
+        return NO_REQUEST;
     }
     LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(), version_.c_str());
-
-    return true;
+    if (!onBody_) {
+        ParsePost_();
+    }
+    return GET_REQUEST;
 }
 
-void HttpRequest::ParsePath_() {
-    if (path_ == "/") {
-        path_ = "/index.html";
+HttpRequest::HTTP_CODE HttpRequest::ParseFraming_() {
+    if (onHeader_) {
+        onHeader_(*this);
+    }
+    string_view te = Header(TRANSFER_ENCODING);
+    string_view cl = Header(CONTENT_LENGTH);
+    if (!te.empty() && known_[CONTENT_LENGTH] >= 0) {
+        // Framed two ways, a proxy in front may have picked the other one
+        LOG_WARN("Both Transfer-Encoding and Content-Length");
+        return BAD_REQUEST;
+    }
+    if (!te.empty()) {
+        // chunked has to be the final coding, others are not supported
+        if (te.size() < 7 || !EqualsNoCase(te.substr(te.size() - 7), "chunked")) {
+            LOG_WARN("Transfer-Encoding %.*s not supported",
+                     static_cast<int>(te.size()), te.data());
+            return BAD_REQUEST;
+        }
+        state_ = CHUNK_SIZE;
+    } else if (known_[CONTENT_LENGTH] < 0) {
+        state_ = FINISH;
+        return NO_REQUEST;
     } else {
-        // Find path in DEFAULT_HTML
-        for (auto &item : DEFAULT_HTML) {
-            if (item == path_) {
-                path_ += ".html";
-                break;
-            }
+        if (cl.empty() || cl.size() > 18 ||
+            !all_of(cl.begin(), cl.end(), [](unsigned char ch) {
+                return isdigit(ch);
+            })) {
+            return BAD_REQUEST;
+        }
+        size_t len = 0;
+        for (char ch : cl) {
+            len = len * 10 + (ch - '0');
+        }
+        if (!onBody_ && len > maxBodySize) {
+            LOG_WARN("Content-Length %lu over %lu", len, maxBodySize.load());
+            return TOO_LARGE_REQUEST;
+        }
+        bodyLeft_ = len;
+        state_ = len ? BODY : FINISH;
+    }
+    expectContinue_ = state_ != FINISH &&
+                      EqualsNoCase(Header(EXPECT), "100-continue");
+    return NO_REQUEST;
+}
+
+bool HttpRequest::ParseChunkSize_(string_view line) {
+    // chunk-size [BWS ; extensions], in hex
+    size_t len = 0, i = 0;
+    for (; i < line.size() && isxdigit(static_cast<unsigned char>(line[i]));
+         i++) {
+        if (len >> 56) {
+            return false;
         }
+        char ch = line[i];
+        len = len * 16 + (isdigit(static_cast<unsigned char>(ch))
+                              ? ch - '0' : ConvertHex(ch));
     }
+    if (i == 0) {
+        return false;
+    }
+    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    // Anything else after the size would be read differently by a proxy
+    if (i < line.size() && line[i] != ';') {
+        return false;
+    }
+    bodyLeft_ = len;
+    state_ = len ? CHUNK_DATA : TRAILER;
+    return true;
+}
+
+HttpRequest::HTTP_CODE HttpRequest::AppendBody_(const char *data, size_t len) {
+    bodySize_ += len;
+    if (onBody_) {
+        return onBody_(data, len) ? NO_REQUEST : BAD_REQUEST;
+    }
+    if (bodySize_ > maxBodySize) {
+        LOG_WARN("Body over %lu", maxBodySize.load());
+        return TOO_LARGE_REQUEST;
+    }
+    body_.append(data, len);
+    return NO_REQUEST;
 }
 
 bool HttpRequest::ParseRequestLine_(const string &line) {
@@ -108,22 +245,48 @@ bool HttpRequest::ParseRequestLine_(const string &line) {
     return false;
 }
 
-void HttpRequest::ParseHeader_(const string &line) {
-    // Header  Key: value
-    regex patten("^([^ :]*): ?(.*)$");
-    smatch subMatch;
-    if (regex_match(line, subMatch, patten)) {
-        header_[subMatch[1]] = subMatch[2];
-    } else {
-        state_ = BODY;
+int HttpRequest::HeaderId_(string_view name) {
+    static const string_view NAME[HEADER_NUM] = {
+        "Connection", "Content-Length", "Content-Type", "Host",
+        "If-None-Match", "If-Range", "Range", "Accept-Encoding",
+        "Transfer-Encoding", "Expect",
+    };
+    for (int id = 0; id < HEADER_NUM; id++) {
+        if (EqualsNoCase(name, NAME[id])) {
+            return id;
+        }
     }
+    return -1;
 }
 
-void HttpRequest::ParseBody_(const string &line) {
-    body_ = line;
-    ParsePost_();
-    state_ = FINISH;
-    LOG_DEBUG("Body:%s, len:%d", line.c_str(), line.size());
+bool HttpRequest::ParseHeader_(string_view line) {
+    // Header  Key: value, no whitespace in the key
+    size_t colon = line.find(':');
+    if (colon == 0 || colon == string_view::npos ||
+        line.substr(0, colon).find_first_of(" \t") != string_view::npos) {
+        LOG_ERROR("Header Error");
+        return false;
+    }
+    if (fieldNum_ == MAX_HEADERS) {
+        LOG_WARN("More than %lu headers", MAX_HEADERS);
+        return false;
+    }
+    string_view name = line.substr(0, colon);
+    string_view value = Trim(line.substr(colon + 1));
+    Field &field = fields_[fieldNum_];
+    field.id = HeaderId_(name);
+    field.nameOff = headerData_.size();
+    field.nameLen = name.size();
+    headerData_.append(name.data(), name.size());
+    field.valueOff = headerData_.size();
+    field.valueLen = value.size();
+    headerData_.append(value.data(), value.size());
+    if (field.id >= 0) {
+        // A repeated header replaces the earlier one
+        known_[field.id] = fieldNum_;
+    }
+    fieldNum_++;
+    return true;
 }
 
 int HttpRequest::ConvertHex(char ch) {
@@ -136,27 +299,15 @@ int HttpRequest::ConvertHex(char ch) {
 
 void HttpRequest::ParsePost_() {
     if (method_ == "POST" &&
-        header_["Content-Type"] == "application/x-www-form-urlencoded") {
+        Header(CONTENT_TYPE) == "application/x-www-form-urlencoded") {
         ParseFromURLencoded_();
-        if (DEFAULT_HTML_TAG.count(path_)) {
-            int tag = DEFAULT_HTML_TAG.find(path_)->second;
-            LOG_DEBUG("Tag:%d", tag);
-            if (tag == 0 || tag == 1) {
-                bool isLogin = (tag == 1);
-                if (UserVerify(post_["username"], post_["password"], isLogin)) {
-                    path_ = "/welcome.html";
-                } else {
-                    path_ = "/error.html";
-                }
-            }
-        }
     }
 }
 
 void HttpRequest::ParseKeyValue_(const string &line) {
     size_t pos = line.find_first_of("=");
     // cout << line.substr(0, pos) << " " << line.substr(pos + 1) << endl;
-    post_[line.substr(0, pos)] = line.substr(pos + 1);
+    post_.emplace_back(line.substr(0, pos), line.substr(pos + 1));
 }
 
 // Parse "username=hellcat&password=123456" --> ["username": "hellcat", "password": "123456"]
@@ -180,55 +331,73 @@ bool HttpRequest::UserVerify(const string &name, const string &pwd,
         return false;
     }
     LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
+    // Hot accounts are answered from memory without taking a connection
+    UserCache *cache = UserCache::Instance();
+    if (isLogin) {
+        UserCache::LOOKUP lookup = cache->Verify(name, pwd);
+        if (lookup != UserCache::MISS) {
+            return lookup == UserCache::MATCH;
+        }
+    } else if (cache->Exists(name)) { // User already exists
+        return false;
+    } else {
+        return Register_(name, pwd);
+    }
     MYSQL *sql;
-    SqlConnect(&sql, SqlConnPool::Instance());
+    SqlConnect conn(&sql, SqlConnPool::Instance());
+    if (!sql) {
+        LOG_WARN("No MySql conn available for %s", name.c_str());
+        return false;
+    }
 
     char sql_query[256] = {'\0'};
     MYSQL_RES *res = nullptr;
-    MYSQL_FIELD *fields = nullptr;
 
-    if (isLogin) {
-        // Query password form MySQL
-        snprintf(sql_query, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
-        if (mysql_query(sql, sql_query)) {
-            mysql_free_result(res);
-            return false;
-        }
-        res = mysql_store_result(sql);
+    // Query password form MySQL
+    snprintf(sql_query, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
+    if (mysql_query(sql, sql_query)) {
+        mysql_free_result(res);
+        return false;
+    }
+    res = mysql_store_result(sql);
 
-        bool check = false;
-        while (MYSQL_ROW row = mysql_fetch_row(res)) {
-            LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
-            string password(row[1]);
-            if (password == pwd) {
-                check = true;
-                break;
-            }
-            LOG_DEBUG("Password error");
+    bool check = false;
+    while (MYSQL_ROW row = mysql_fetch_row(res)) {
+        LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
+        string password(row[1]);
+        cache->Put(name, password);
+        if (password == pwd) {
+            check = true;
+            break;
         }
-        mysql_free_result(res);
-        return check;
+        LOG_DEBUG("Password error");
+    }
+    mysql_free_result(res);
+    return check;
+}
+
+bool HttpRequest::Register_(const string &name, const string &pwd) {
+    RegisterBatcher::RESULT result;
+    if (RegisterBatcher::Instance()->IsOpen()) {
+        // Group commit with other concurrent registers
+        result = RegisterBatcher::Instance()->Submit(name, pwd).get();
     } else {
-        snprintf(sql_query, 256,
-            "SELECT username, password FROM user WHERE username='%s' LIMIT 1",
-            name.c_str());
-        if (mysql_query(sql, sql_query)) {
-            mysql_free_result(res);
-            return false;
-        }
-        res = mysql_store_result(sql);
-        if (mysql_num_rows(res)) { // User already exists
-            return false;
-        }
-        snprintf(sql_query, 256, "INSERT INTO user(username, password) VALUES('%s','%s')", name.c_str(), pwd.c_str());
-        if (mysql_query(sql, sql_query)) {
-            LOG_DEBUG("Insert error!");
+        MYSQL *sql;
+        SqlConnect conn(&sql, SqlConnPool::Instance());
+        if (!sql) {
+            LOG_WARN("No MySql conn available for %s", name.c_str());
             return false;
         }
-        return true;
+        result = RegisterBatcher::InsertOne(sql, name, pwd);
     }
-
-    return false;
+    if (result == RegisterBatcher::SUCCESS) {
+        // Write through so the first login after register is a hit
+        UserCache::Instance()->Put(name, pwd);
+    } else if (result == RegisterBatcher::FAILED) {
+        LOG_DEBUG("Insert error!");
+        UserCache::Instance()->Invalidate(name);
+    }
+    return result == RegisterBatcher::SUCCESS;
 }
 
 string HttpRequest::path() const { return path_; }
@@ -239,10 +408,76 @@ string HttpRequest::method() const { return method_; }
 
 string HttpRequest::version() const { return version_; }
 
+string HttpRequest::GetHeader(const string &key) const {
+    int id = HeaderId_(key);
+    if (id >= 0) {
+        return string(Header(static_cast<HEADER_FIELD>(id)));
+    }
+    for (size_t i = fieldNum_; i-- > 0;) {
+        const Field &field = fields_[i];
+        if (EqualsNoCase(string_view(headerData_.data() + field.nameOff,
+                                     field.nameLen), key)) {
+            return string(Value_(field));
+        }
+    }
+    return "";
+}
+
+bool HttpRequest::GetRanges(vector<ByteRange> &ranges) const {
+    ranges.clear();
+    string_view value = Header(RANGE);
+    if (value.compare(0, 6, "bytes=") != 0) {
+        return false;
+    }
+    size_t pos = 6;
+    while (pos <= value.size()) {
+        size_t end = min(value.find(',', pos), value.size());
+        size_t dash = value.find('-', pos);
+        if (dash >= end || ranges.size() == MAX_RANGES) {
+            return false;
+        }
+        // Digits only, spaces around a spec are allowed
+        auto number = [&value](size_t begin, size_t stop, int64_t &out) {
+            while (begin < stop && value[begin] == ' ') {
+                begin++;
+            }
+            while (stop > begin && value[stop - 1] == ' ') {
+                stop--;
+            }
+            if (begin == stop) {
+                out = -1;
+                return true;
+            }
+            out = 0;
+            for (size_t i = begin; i < stop; i++) {
+                if (!isdigit(static_cast<unsigned char>(value[i])) ||
+                    out > (INT64_MAX - 9) / 10) {
+                    return false;
+                }
+                out = out * 10 + (value[i] - '0');
+            }
+            return true;
+        };
+        ByteRange range;
+        if (!number(pos, dash, range.first) ||
+            !number(dash + 1, end, range.last) ||
+            (range.first < 0 && range.last < 0) ||
+            (range.first >= 0 && range.last >= 0 && range.last < range.first)) {
+            return false;
+        }
+        ranges.push_back(range);
+        pos = end + 1;
+    }
+    return !ranges.empty();
+}
+
 string HttpRequest::GetPostValueByKey(const string &key) const {
     assert(key != "");
-    if (post_.count(key) == 1) {
-        return post_.find(key)->second;  // !NOT post_[key]
+    // A repeated key keeps the last value
+    for (auto it = post_.rbegin(); it != post_.rend(); ++it) {
+        if (it->first == key) {
+            return it->second;
+        }
     }
     return "";
 }
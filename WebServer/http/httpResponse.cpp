@@ -1,3 +1,5 @@
+#include <cstdio>
+#include <cstring>
 #include <unordered_map>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -7,6 +9,12 @@
 #include "log.h"
 using namespace std;
 
+namespace {
+
+const char BOUNDARY[] = "TinyWebServerByteRanges";
+
+}  // namespace
+
 const unordered_map<string, string> HttpResponse::SUFFIX_TYPE = {
     {".html", "text/html"},
     {".xml", "text/xml"},
@@ -27,25 +35,38 @@ const unordered_map<string, string> HttpResponse::SUFFIX_TYPE = {
     {".tar", "application/x-tar"},
     {".css", "text/css "},
     {".js", "text/javascript "},
+    {".svg", "image/svg+xml"},
+    {".mp4", "video/mp4"},
+    {".webm", "video/webm"},
 };
 
 const unordered_map<int, string> HttpResponse::CODE_STATUS = {
     {200, "OK"},
+    {206, "Partial Content"},
     {400, "Bad Request"},
     {403, "Forbidden"},
     {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {413, "Payload Too Large"},
+    {416, "Range Not Satisfiable"},
+    {503, "Service Unavailable"},
 };
 
 const unordered_map<int, string> HttpResponse::CODE_PATH = {
     {400, "/400.html"},
     {403, "/403.html"},
     {404, "/404.html"},
+    {405, "/405.html"},
+    {413, "/413.html"},
 };
 
 HttpResponse::HttpResponse() {
     code_ = -1;
     path_ = srcDir_ = "";
     isKeepAlive_ = false;
+    encoding_ = Encoding::IDENTITY;
+    isVary_ = false;
+    isChunked_ = false;
     file_ = nullptr;
     fileState_ = {0};
 };
@@ -55,12 +76,23 @@ HttpResponse::~HttpResponse() {
 }
 
 void HttpResponse::Init(const string &srcDir, string &path,
-                        bool isKeepAlive, int code) {
+                        bool isKeepAlive, int code,
+                        const string &acceptEncoding) {
     if (file_) {
         UnmapFile();
     }
     code_ = code;
     isKeepAlive_ = isKeepAlive;
+    acceptEncoding_ = acceptEncoding;
+    encoding_ = Encoding::IDENTITY;
+    isVary_ = false;
+    etag_.clear();
+    rangeSpecs_.clear();
+    ifRange_.clear();
+    ranges_.clear();
+    body_.clear();
+    source_ = nullptr;
+    isChunked_ = false;
     path_ = path;
     srcDir_ = srcDir;
     file_ = nullptr;
@@ -68,7 +100,9 @@ void HttpResponse::Init(const string &srcDir, string &path,
 }
 
 void HttpResponse::MakeResponse(Buffer &buff) {
-    if (stat((srcDir_ + path_).data(), &fileState_) < 0
+    if (code_ >= 400) {
+        // Request rejected before the path means anything, error page only
+    } else if (stat((srcDir_ + path_).data(), &fileState_) < 0
         || S_ISDIR(fileState_.st_mode)) { // File does not exists or file is directory
         code_ = 404;
     } else if (!(fileState_.st_mode & S_IROTH)) {
@@ -77,9 +111,152 @@ void HttpResponse::MakeResponse(Buffer &buff) {
         code_ = 200;
     }
     ErrorHtml_();
+    string type = GetFileType_();
+    if (code_ == 200) {
+        etag_ = ETag(fileState_);
+        if (!rangeSpecs_.empty() && (ifRange_.empty() || ifRange_ == etag_)) {
+            ResolveRanges_();
+        }
+    }
+    // Ranges are served from the identity representation
+    if (ranges_.empty() && code_ != 416 && Encoding::IsCompressible(type)) {
+        NegotiateFile_();
+    }
+    AddStateLine_(buff);
+    AddHeader_(buff, ranges_.size() > 1
+                         ? string("multipart/byteranges; boundary=") + BOUNDARY
+                         : type);
+    if (code_ == 416) {
+        buff.append("Content-Range: bytes */" + to_string(fileState_.st_size)
+                    + "\r\nContent-length: 0\r\n\r\n");
+        return;
+    }
+    AddContent_(buff, type);
+}
+
+void HttpResponse::SetRanges(const vector<HttpRequest::ByteRange> &ranges,
+                             const string &ifRange) {
+    rangeSpecs_ = ranges;
+    ifRange_ = ifRange;
+}
+
+void HttpResponse::ResolveRanges_() {
+    int64_t size = fileState_.st_size;
+    for (const HttpRequest::ByteRange &spec : rangeSpecs_) {
+        int64_t first, last;
+        if (spec.first < 0) {
+            // Suffix, the last spec.last bytes, none of an empty file
+            if (spec.last == 0 || size == 0) {
+                continue;
+            }
+            first = max<int64_t>(0, size - spec.last);
+            last = size - 1;
+        } else {
+            if (spec.first >= size) {
+                continue;
+            }
+            first = spec.first;
+            last = spec.last < 0 || spec.last >= size ? size - 1 : spec.last;
+        }
+        ranges_.emplace_back(first, last - first + 1);
+    }
+    code_ = ranges_.empty() ? 416 : 206;
+}
+
+void HttpResponse::MakeResponse(Buffer &buff, const string &type,
+                                const string &body) {
+    if (code_ == -1) {
+        code_ = 200;
+    }
+    // Dynamic bodies are compressed per response, with a fast level
+    string compressed;
+    const string *content = &body;
+    if (Encoding::IsCompressible(type) && body.size() >= Encoding::MIN_SIZE) {
+        isVary_ = true;
+        encoding_ = Encoding::Negotiate(acceptEncoding_,
+                                        1u << Encoding::GZIP |
+                                        1u << Encoding::BROTLI);
+        if (encoding_ != Encoding::IDENTITY) {
+            if (Encoding::Compress(encoding_, body.data(), body.size(),
+                                   compressed)) {
+                content = &compressed;
+            } else {
+                encoding_ = Encoding::IDENTITY;
+            }
+        }
+    }
+    AddStateLine_(buff);
+    AddHeader_(buff, type);
+    buff.append("Content-length: " + to_string(content->size()) +
+                "\r\n\r\n");
+    buff.append(*content);
+}
+
+void HttpResponse::MakeStream(Buffer &buff, const string &type,
+                              StreamSource source, bool isChunked) {
+    if (code_ == -1) {
+        code_ = 200;
+    }
+    source_ = move(source);
+    isChunked_ = isChunked;
+    // Without chunks the end of the body is the end of the connection
+    isKeepAlive_ = isKeepAlive_ && isChunked_;
     AddStateLine_(buff);
-    AddHeader_(buff);
-    AddContent_(buff);
+    AddHeader_(buff, type);
+    buff.append(isChunked_ ? "Transfer-Encoding: chunked\r\n\r\n" : "\r\n");
+}
+
+bool HttpResponse::NextPiece(Buffer &buff) {
+    if (!source_) {
+        return false;
+    }
+    piece_.clear();
+    bool more = source_(piece_, STREAM_PIECE);
+    if (!piece_.empty()) {
+        if (isChunked_) {
+            char size[24];
+            snprintf(size, sizeof(size), "%zx\r\n", piece_.size());
+            buff.append(size, strlen(size));
+            piece_ += "\r\n";
+        }
+        buff.append(piece_);
+    }
+    if (!more) {
+        if (isChunked_) {
+            buff.append("0\r\n\r\n");
+        }
+        source_ = nullptr;
+    }
+    // Keep the scratch from growing with one oversized piece
+    if (piece_.capacity() > 4 * STREAM_PIECE) {
+        string().swap(piece_);
+    }
+    return true;
+}
+
+void HttpResponse::NegotiateFile_() {
+    if (Encoding::Negotiate(acceptEncoding_, 1u << Encoding::GZIP |
+                            1u << Encoding::BROTLI) == Encoding::IDENTITY) {
+        return;
+    }
+    // Only stat the siblings when the client takes a compressed variant
+    unsigned available = 0;
+    struct stat states[Encoding::TYPE_NUM];
+    for (int e = Encoding::GZIP; e < Encoding::TYPE_NUM; e++) {
+        string path = srcDir_ + path_ + Encoding::Suffix(
+            static_cast<Encoding::TYPE>(e));
+        if (stat(path.data(), &states[e]) == 0 && S_ISREG(states[e].st_mode)
+            && (states[e].st_mode & S_IROTH)
+            && states[e].st_mtime >= fileState_.st_mtime) {
+            available |= 1u << e;
+        }
+    }
+    isVary_ = available != 0;
+    encoding_ = Encoding::Negotiate(acceptEncoding_, available);
+    if (encoding_ != Encoding::IDENTITY) {
+        etag_ = ETag(fileState_, encoding_);
+        fileState_ = states[encoding_];
+    }
 }
 
 char* HttpResponse::File() {
@@ -108,7 +285,7 @@ void HttpResponse::AddStateLine_(Buffer& buff) {
     buff.append("HTTP/1.1 " + to_string(code_) + " " + status + "\r\n");
 }
 
-void HttpResponse::AddHeader_(Buffer& buff) {
+void HttpResponse::AddHeader_(Buffer& buff, const string &type) {
     buff.append("Connection: ");
     if (isKeepAlive_) {
         buff.append("keep-alive\r\n");
@@ -116,11 +293,22 @@ void HttpResponse::AddHeader_(Buffer& buff) {
     } else {
         buff.append("close\r\n");
     }
-    buff.append("Content-type: " + GetFileType_() + "\r\n");
+    buff.append("Content-type: " + type + "\r\n");
+    if (encoding_ != Encoding::IDENTITY) {
+        buff.append(string("Content-Encoding: ") + Encoding::Name(encoding_) +
+                    "\r\n");
+    }
+    if (isVary_) {
+        buff.append("Vary: Accept-Encoding\r\n");
+    }
+    if (!etag_.empty()) {
+        buff.append("Accept-Ranges: bytes\r\nETag: " + etag_ + "\r\n");
+    }
 }
 
-void HttpResponse::AddContent_(Buffer &buff) {
-    int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
+void HttpResponse::AddContent_(Buffer &buff, const string &type) {
+    int srcFd = open((srcDir_ + path_ + Encoding::Suffix(encoding_)).data(),
+                     O_RDONLY | O_CLOEXEC);
     if (srcFd < 0) {
         ErrorContent(buff, "File not found");
         return;
@@ -137,8 +325,43 @@ void HttpResponse::AddContent_(Buffer &buff) {
     }
 
     close(srcFd);
-    // Header + blank
-    buff.append("Content-length: " + to_string(fileState_.st_size) + "\r\n\r\n");
+    string size = to_string(fileState_.st_size);
+    if (ranges_.empty()) {
+        // Header + blank
+        buff.append("Content-length: " + size + "\r\n\r\n");
+        body_.push_back({file_, static_cast<size_t>(fileState_.st_size)});
+    } else if (ranges_.size() == 1) {
+        size_t offset = ranges_[0].first, len = ranges_[0].second;
+        buff.append("Content-Range: bytes " + to_string(offset) + "-" +
+                    to_string(offset + len - 1) + "/" + size + "\r\n");
+        buff.append("Content-length: " + to_string(len) + "\r\n\r\n");
+        body_.push_back({file_ + offset, len});
+    } else {
+        // multipart/byteranges, part headers live in parts_
+        parts_.clear();
+        vector<size_t> partEnds;
+        size_t total = 0;
+        for (const auto &range : ranges_) {
+            parts_ += string("\r\n--") + BOUNDARY + "\r\nContent-type: " +
+                      type + "\r\nContent-Range: bytes " +
+                      to_string(range.first) + "-" +
+                      to_string(range.first + range.second - 1) + "/" + size +
+                      "\r\n\r\n";
+            partEnds.push_back(parts_.size());
+            total += range.second;
+        }
+        parts_ += string("\r\n--") + BOUNDARY + "--\r\n";
+        total += parts_.size();
+        buff.append("Content-length: " + to_string(total) + "\r\n\r\n");
+
+        size_t partBegin = 0;
+        for (size_t i = 0; i < ranges_.size(); i++) {
+            body_.push_back({&parts_[partBegin], partEnds[i] - partBegin});
+            body_.push_back({file_ + ranges_[i].first, ranges_[i].second});
+            partBegin = partEnds[i];
+        }
+        body_.push_back({&parts_[partBegin], parts_.size() - partBegin});
+    }
 }
 
 void HttpResponse::UnmapFile() {
@@ -148,13 +371,26 @@ void HttpResponse::UnmapFile() {
     }
 }
 
+string HttpResponse::ETag(const struct stat &st, Encoding::TYPE encoding) {
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"",
+             static_cast<unsigned long>(st.st_mtime),
+             static_cast<unsigned long>(st.st_size),
+             Encoding::Suffix(encoding));
+    return etag;
+}
+
 string HttpResponse::GetFileType_() {
+    return FileType(path_);
+}
+
+string HttpResponse::FileType(const string &path) {
     // Determine file type
-    string::size_type idx = path_.find_last_of('.');
+    string::size_type idx = path.find_last_of('.');
     if (idx == string::npos) {
         return "text/plain";
     }
-    string suffix = path_.substr(idx);
+    string suffix = path.substr(idx);
     if (SUFFIX_TYPE.count(suffix) == 1) {
         return SUFFIX_TYPE.find(suffix)->second;
     }
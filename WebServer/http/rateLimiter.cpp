@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "ratelimiter.h"
+
+using namespace std;
+
+RateLimiter *RateLimiter::Instance() {
+    static RateLimiter limiter;
+    return &limiter;
+}
+
+/**
+ * @brief Init rate limiter
+ *
+ * @param requestRate Requests per second and client, <= 0 for no limit
+ * @param requestBurst Requests a client may send at once
+ * @param byteRate Bytes per second and client, <= 0 for no limit
+ * @param byteBurst Bytes a client may move at once
+ * @param shardNum Number of independently locked tables, a power of two
+ */
+void RateLimiter::Init(double requestRate, double requestBurst,
+                       double byteRate, double byteBurst, size_t shardNum) {
+    assert(shardNum > 0 && (shardNum & (shardNum - 1)) == 0);
+    shardNum_ = shardNum;
+    sweepNext_ = 0;
+    shards_.reset(new Shard[shardNum_]);
+    Set(requestRate, requestBurst, byteRate, byteBurst);
+}
+
+void RateLimiter::Set(double requestRate, double requestBurst,
+                      double byteRate, double byteBurst) {
+    requestRate = max(requestRate, 0.0);
+    byteRate = max(byteRate, 0.0);
+    requestBurst = max(requestBurst, 1.0);
+    byteBurst = max(byteBurst, 0.0);
+    bool isOpen = requestRate > 0 || byteRate > 0;
+    double fullS = 0;
+    if (requestRate > 0) {
+        fullS = requestBurst / requestRate;
+    }
+    if (byteRate > 0) {
+        fullS = max(fullS, byteBurst / byteRate);
+    }
+
+    // Shards are never locked two at a time elsewhere, no deadlock
+    for (size_t i = 0; i < shardNum_; i++) {
+        shards_[i].mtx.lock();
+    }
+    requestRate_ = requestRate;
+    requestBurst_ = requestBurst;
+    byteRate_ = byteRate;
+    byteBurst_ = byteBurst;
+    fullUs_ = static_cast<int64_t>(fullS * 1e6);
+    for (size_t i = 0; i < shardNum_; i++) {
+        if (!isOpen) {
+            shards_[i].buckets.clear();
+        }
+        shards_[i].mtx.unlock();
+    }
+    // Time until the next request token, the byte debt is not known here
+    retryAfterS_ = static_cast<int>(
+        ceil(requestRate > 0 ? max(1 / requestRate, 1.0) : 1.0));
+    isOpen_ = isOpen;
+}
+
+string RateLimiter::Reply(bool isKeepAlive) const {
+    string reply = "HTTP/1.1 429 Too Many Requests\r\nConnection: ";
+    reply += isKeepAlive ? "keep-alive\r\nkeep-alive: max=6, timeout=120\r\n"
+                         : "close\r\n";
+    reply += "Retry-After: " + to_string(retryAfterS_.load()) + "\r\n";
+    reply += "Content-length: 0\r\n\r\n";
+    return reply;
+}
+
+void RateLimiter::Refill_(double &tokens, double rate, double burst,
+                          int64_t elapsedUs) {
+    tokens = min(burst, tokens + rate * elapsedUs / 1e6);
+}
+
+RateLimiter::Shard &RateLimiter::ShardOf_(in_addr_t ip) const {
+    // Fibonacci hash, neighbouring addresses land in different shards
+    return shards_[(static_cast<uint32_t>(ip) * 2654435761u >> 16) &
+                   (shardNum_ - 1)];
+}
+
+RateLimiter::Bucket &RateLimiter::Take_(Shard &shard, in_addr_t ip,
+                                        uint64_t bytes, int64_t nowUs) {
+    auto result = shard.buckets.try_emplace(
+        ip, Bucket{requestBurst_, byteBurst_, nowUs});
+    Bucket &bucket = result.first->second;
+    if (!result.second) {
+        int64_t elapsed = max<int64_t>(nowUs - bucket.lastUs, 0);
+        Refill_(bucket.requests, requestRate_, requestBurst_, elapsed);
+        Refill_(bucket.bytes, byteRate_, byteBurst_, elapsed);
+        bucket.lastUs = nowUs;
+    }
+    bucket.bytes -= bytes;
+    return bucket;
+}
+
+bool RateLimiter::Allow(in_addr_t ip, uint64_t bytes, int64_t nowUs) {
+    if (!isOpen_) {
+        return true;
+    }
+    Shard &shard = ShardOf_(ip);
+    lock_guard<mutex> locker(shard.mtx);
+    Bucket &bucket = Take_(shard, ip, bytes, nowUs);
+    if ((requestRate_ > 0 && bucket.requests < 1) ||
+        (byteRate_ > 0 && bucket.bytes < 0)) {
+        return false;
+    }
+    bucket.requests -= 1;
+    return true;
+}
+
+void RateLimiter::Charge(in_addr_t ip, uint64_t bytes, int64_t nowUs) {
+    if (!isOpen_ || bytes == 0) {
+        return;
+    }
+    Shard &shard = ShardOf_(ip);
+    lock_guard<mutex> locker(shard.mtx);
+    if (byteRate_ > 0) {
+        Take_(shard, ip, bytes, nowUs);
+    }
+}
+
+int RateLimiter::Sweep(int64_t nowUs) {
+    if (!isOpen_) {
+        return -1;
+    }
+    Shard &shard = shards_[sweepNext_];
+    sweepNext_ = (sweepNext_ + 1) & (shardNum_ - 1);
+    int64_t fullUs;
+    {
+        lock_guard<mutex> locker(shard.mtx);
+        fullUs = fullUs_;
+        for (auto it = shard.buckets.begin(); it != shard.buckets.end();) {
+            Bucket bucket = it->second;
+            int64_t elapsed = nowUs - bucket.lastUs;
+            Refill_(bucket.requests, requestRate_, requestBurst_, elapsed);
+            Refill_(bucket.bytes, byteRate_, byteBurst_, elapsed);
+            // Full again (or unlimited), a new bucket would be the same
+            if ((requestRate_ <= 0 || bucket.requests >= requestBurst_) &&
+                (byteRate_ <= 0 || bucket.bytes >= byteBurst_)) {
+                it = shard.buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Every shard once per refill time, but at most one shard per ms
+    int64_t periodMS = max<int64_t>(fullUs / 1000, 1000) /
+                       static_cast<int64_t>(shardNum_);
+    return static_cast<int>(max<int64_t>(periodMS, 1));
+}
+
+size_t RateLimiter::Size() const {
+    size_t size = 0;
+    for (size_t i = 0; isOpen_ && i < shardNum_; i++) {
+        lock_guard<mutex> locker(shards_[i].mtx);
+        size += shards_[i].buckets.size();
+    }
+    return size;
+}
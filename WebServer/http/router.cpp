@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cstring>
+
+#include "router.h"
+#include "log.h"
+
+using namespace std;
+
+Router *Router::Instance() {
+    static Router router;
+    return &router;
+}
+
+void Router::Clear() {
+    nodes_.clear();
+    routes_.clear();
+    NewNode_("");
+}
+
+int Router::NewNode_(const string &label) {
+    Node node;
+    node.label = label;
+    fill(node.exact, node.exact + METHOD_NUM, -1);
+    fill(node.prefix, node.prefix + METHOD_NUM, -1);
+    nodes_.push_back(move(node));
+    return nodes_.size() - 1;
+}
+
+int Router::InsertStatic_(int node, const string &text) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        auto it = find_if(nodes_[node].children.begin(),
+                          nodes_[node].children.end(),
+                          [&](const pair<char, int> &c) {
+                              return c.first == text[pos];
+                          });
+        if (it == nodes_[node].children.end()) {
+            int child = NewNode_(text.substr(pos));
+            nodes_[node].children.emplace_back(text[pos], child);
+            return child;
+        }
+        int child = it->second;
+        const string &label = nodes_[child].label;
+        size_t common = 0;
+        while (common < label.size() && pos + common < text.size() &&
+               label[common] == text[pos + common]) {
+            common++;
+        }
+        if (common < label.size()) {
+            // Split the edge: child keeps the common part, the rest moves
+            // down into a new node with all of child's routes and children
+            int rest = NewNode_(label.substr(common));
+            Node &lower = nodes_[rest];
+            Node &upper = nodes_[child];
+            swap(lower.children, upper.children);
+            swap(lower.param, upper.param);
+            swap(lower.paramName, upper.paramName);
+            swap(lower.exact, upper.exact);
+            swap(lower.prefix, upper.prefix);
+            upper.label.resize(common);
+            upper.children.emplace_back(lower.label[0], rest);
+        }
+        node = child;
+        pos += common;
+    }
+    return node;
+}
+
+bool Router::Add(METHOD method, const string &pattern, Handler handler,
+                 bool isBlocking) {
+    return Add_({method, pattern, move(handler), isBlocking, nullptr});
+}
+
+bool Router::AddUpload(METHOD method, const string &pattern,
+                       UploadHandler upload, bool isBlocking) {
+    return Add_({method, pattern, nullptr, isBlocking, move(upload)});
+}
+
+bool Router::Add_(Route route) {
+    const string &pattern = route.pattern;
+    if (pattern.empty() || pattern[0] != '/' ||
+        !(route.handler || route.upload)) {
+        LOG_ERROR("Route %s malformed", pattern.c_str());
+        return false;
+    }
+    int node = 0;
+    bool isPrefix = false;
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+        if (pattern[pos] == '*') {
+            // Only as the last character
+            if (pos + 1 != pattern.size()) {
+                LOG_ERROR("Route %s: '*' must be last", pattern.c_str());
+                return false;
+            }
+            isPrefix = true;
+            break;
+        }
+        if (pattern[pos] == ':') {
+            size_t end = min(pattern.find('/', pos), pattern.size());
+            string name = pattern.substr(pos + 1, end - pos - 1);
+            if (name.empty() || pattern[pos - 1] != '/' ||
+                name.find_first_of(":*") != string::npos) {
+                LOG_ERROR("Route %s: bad parameter", pattern.c_str());
+                return false;
+            }
+            if (nodes_[node].param < 0) {
+                int param = NewNode_("");
+                nodes_[node].param = param;
+                nodes_[node].paramName = name;
+            } else if (nodes_[node].paramName != name) {
+                LOG_ERROR("Route %s: parameter %s already named %s",
+                          pattern.c_str(), name.c_str(),
+                          nodes_[node].paramName.c_str());
+                return false;
+            }
+            node = nodes_[node].param;
+            pos = end;
+            continue;
+        }
+        size_t end = min(pattern.find_first_of(":*", pos), pattern.size());
+        node = InsertStatic_(node, pattern.substr(pos, end - pos));
+        pos = end;
+    }
+    int &slot = isPrefix ? nodes_[node].prefix[route.method]
+                         : nodes_[node].exact[route.method];
+    if (slot >= 0) {
+        LOG_ERROR("Route %s registered twice", pattern.c_str());
+        return false;
+    }
+    slot = routes_.size();
+    routes_.push_back(move(route));
+    return true;
+}
+
+bool Router::Alias(const string &path, const string &file) {
+    return Add(GET, path, [file](const HttpRequest&, const Params&,
+                                 Reply &reply) {
+        reply.path = file;
+    });
+}
+
+bool Router::HasAny_(const int *routes) {
+    return any_of(routes, routes + METHOD_NUM, [](int r) { return r >= 0; });
+}
+
+int Router::Match_(int index, const char *pos, const char *end, int method,
+                   Params &params, bool &pathFound) const {
+    const Node &node = nodes_[index];
+    if (pos == end) {
+        if (node.exact[method] >= 0) {
+            return node.exact[method];
+        }
+        pathFound = pathFound || HasAny_(node.exact);
+    } else {
+        // Static edges first, at most one starts with *pos
+        for (const auto &child : node.children) {
+            if (child.first != *pos) {
+                continue;
+            }
+            const string &label = nodes_[child.second].label;
+            if (static_cast<size_t>(end - pos) >= label.size() &&
+                memcmp(pos, label.data(), label.size()) == 0) {
+                int route = Match_(child.second, pos + label.size(), end,
+                                   method, params, pathFound);
+                if (route >= 0) {
+                    return route;
+                }
+            }
+            break;
+        }
+        if (node.param >= 0 && *pos != '/') {
+            const char *segEnd = find(pos, end, '/');
+            params.emplace_back(node.paramName, string(pos, segEnd));
+            int route = Match_(node.param, segEnd, end, method, params,
+                               pathFound);
+            if (route >= 0) {
+                return route;
+            }
+            params.pop_back();
+        }
+    }
+    if (node.prefix[method] >= 0) {
+        return node.prefix[method];
+    }
+    pathFound = pathFound || HasAny_(node.prefix);
+    return -1;
+}
+
+Router::RESULT Router::Find(const string &method, const string &path,
+                            const Route *&route, Params &params) const {
+    params.clear();
+    route = nullptr;
+    int id = MethodOf(method);
+    if (id < 0 || routes_.empty()) {
+        return NOT_FOUND;
+    }
+    bool pathFound = false;
+    int index = Match_(0, path.data(), path.data() + path.size(), id, params,
+                       pathFound);
+    if (index < 0) {
+        params.clear();
+        return pathFound ? NOT_ALLOWED : NOT_FOUND;
+    }
+    route = &routes_[index];
+    return FOUND;
+}
+
+int Router::MethodOf(const string &method) {
+    static const char *NAME[] = {
+        "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH",
+    };
+    for (int i = 0; i < METHOD_NUM; i++) {
+        if (method == NAME[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+string Router::Param(const Params &params, const string &name) {
+    for (const auto &param : params) {
+        if (param.first == name) {
+            return param.second;
+        }
+    }
+    return "";
+}
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "staticbundle.h"
+#include "httpResponse.h"
+#include "encoding.h"
+#include "log.h"
+
+using namespace std;
+
+shared_ptr<const StaticBundle> StaticBundle::current_;
+atomic<uint64_t> StaticBundle::generation_{0};
+
+namespace {
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+const uint32_t EMPTY_SLOT = UINT32_MAX;
+
+struct File {
+    string path;      // URL path, "/css/style.css"
+    string fullPath;
+    struct stat st;
+};
+
+// Regular files readable by others, the ones MakeResponse() would serve
+void Walk(const string &dir, const string &prefix, size_t maxFileSize,
+          vector<File> &files) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (struct dirent *entry = readdir(d)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        File file;
+        file.path = prefix + "/" + entry->d_name;
+        file.fullPath = dir + "/" + entry->d_name;
+        if (stat(file.fullPath.c_str(), &file.st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(file.st.st_mode)) {
+            Walk(file.fullPath, file.path, maxFileSize, files);
+        } else if (S_ISREG(file.st.st_mode) && (file.st.st_mode & S_IROTH)
+                   && static_cast<size_t>(file.st.st_size) <= maxFileSize) {
+            files.push_back(move(file));
+        }
+    }
+    closedir(d);
+}
+
+bool ReadFile(const string &path, size_t size, string &out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    out.resize(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t len = read(fd, &out[done], size - done);
+        if (len <= 0) {
+            break;
+        }
+        done += len;
+    }
+    close(fd);
+    return done == size;
+}
+
+string Header(const File &file, const string &type, Encoding::TYPE encoding,
+              size_t bodyLen, bool isVary, bool isKeepAlive) {
+    string header = "HTTP/1.1 200 OK\r\nConnection: ";
+    if (isKeepAlive) {
+        header += "keep-alive\r\nkeep-alive: max=6, timeout=120\r\n";
+    } else {
+        header += "close\r\n";
+    }
+    header += "Content-type: " + type + "\r\n";
+    if (encoding != Encoding::IDENTITY) {
+        header += string("Content-Encoding: ") + Encoding::Name(encoding) +
+                  "\r\n";
+    }
+    if (isVary) {
+        header += "Vary: Accept-Encoding\r\n";
+    }
+    // Range requests bypass the bundle and are served from the file
+    header += "Accept-Ranges: bytes\r\n";
+    header += "ETag: " + HttpResponse::ETag(file.st, encoding) + "\r\n";
+    header += "Content-length: " + to_string(bodyLen) + "\r\n\r\n";
+    return header;
+}
+
+// A .gz/.br sibling from a build step, if at least as new as the file
+bool ReadSibling(const File &file, Encoding::TYPE encoding, string &out) {
+    struct stat st;
+    string path = file.fullPath + Encoding::Suffix(encoding);
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+           && st.st_mtime >= file.st.st_mtime
+           && ReadFile(path, st.st_size, out);
+}
+
+size_t Bucket(uint64_t h, size_t bucketNum) {
+    return ((h * 0x9E3779B97F4A7C15ull) >> 32) % bucketNum;
+}
+
+}  // namespace
+
+StaticBundle::~StaticBundle() {
+    if (arena_) {
+        munmap(arena_, arenaSize_);
+    }
+}
+
+shared_ptr<const StaticBundle> StaticBundle::Build(const string &srcDir,
+                                                   size_t maxFileSize) {
+    vector<File> files;
+    string root = srcDir;
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    Walk(root, "", maxFileSize, files);
+
+    // Read and compress everything first, the arena is sized afterwards
+    struct Loaded {
+        string path;
+        string headers[Encoding::TYPE_NUM][2];
+        string bodies[Encoding::TYPE_NUM];
+        unsigned encodings;
+    };
+    vector<Loaded> loaded;
+    size_t total = 0;
+    for (const File &file : files) {
+        Loaded item;
+        item.path = file.path;
+        item.encodings = 1u << Encoding::IDENTITY;
+        string &body = item.bodies[Encoding::IDENTITY];
+        if (!ReadFile(file.fullPath, file.st.st_size, body)) {
+            // Changed while loading, leave it to the mmap path
+            continue;
+        }
+        string type = HttpResponse::FileType(file.path);
+        if (Encoding::IsCompressible(type) && body.size() >= Encoding::MIN_SIZE) {
+            for (int e = Encoding::GZIP; e < Encoding::TYPE_NUM; e++) {
+                Encoding::TYPE encoding = static_cast<Encoding::TYPE>(e);
+                string &out = item.bodies[e];
+                if (!ReadSibling(file, encoding, out) &&
+                    !Encoding::Compress(encoding, body.data(), body.size(),
+                                        out, true)) {
+                    out.clear();
+                }
+                // Keep only variants that save at least 10%
+                if (!out.empty() && out.size() < body.size() * 9 / 10) {
+                    item.encodings |= 1u << e;
+                } else {
+                    out.clear();
+                }
+            }
+        }
+        bool isVary = item.encodings != (1u << Encoding::IDENTITY);
+        for (int e = 0; e < Encoding::TYPE_NUM; e++) {
+            if (!(item.encodings & (1u << e))) {
+                continue;
+            }
+            for (int keepAlive = 0; keepAlive < 2; keepAlive++) {
+                item.headers[e][keepAlive] = Header(
+                    file, type, static_cast<Encoding::TYPE>(e),
+                    item.bodies[e].size(), isVary, keepAlive);
+                total += item.headers[e][keepAlive].size();
+            }
+            total += item.bodies[e].size();
+        }
+        loaded.push_back(move(item));
+    }
+
+    // One arena on 2MB pages if any are reserved, else ask for THP
+    shared_ptr<StaticBundle> bundle(new StaticBundle());
+    bundle->arenaSize_ = max<size_t>(
+        (total + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE,
+        HUGE_PAGE_SIZE);
+    void *arena = mmap(nullptr, bundle->arenaSize_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    bundle->isHugePage_ = arena != MAP_FAILED;
+    if (arena == MAP_FAILED) {
+        arena = mmap(nullptr, bundle->arenaSize_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            LOG_ERROR("StaticBundle arena of %lu bytes failed",
+                      bundle->arenaSize_);
+            return nullptr;
+        }
+        madvise(arena, bundle->arenaSize_, MADV_HUGEPAGE);
+    }
+    bundle->arena_ = static_cast<char*>(arena);
+
+    char *pos = bundle->arena_;
+    auto copy = [&pos](const string &data) {
+        memcpy(pos, data.data(), data.size());
+        pos += data.size();
+        return pos - data.size();
+    };
+    for (const Loaded &item : loaded) {
+        Asset asset;
+        memset(&asset, 0, sizeof(asset));
+        asset.encodings = item.encodings;
+        for (int e = 0; e < Encoding::TYPE_NUM; e++) {
+            if (!(item.encodings & (1u << e))) {
+                continue;
+            }
+            Variant &variant = asset.variants[e];
+            for (int keepAlive = 0; keepAlive < 2; keepAlive++) {
+                variant.header[keepAlive] = copy(item.headers[e][keepAlive]);
+                variant.headerLen[keepAlive] = item.headers[e][keepAlive].size();
+            }
+            variant.body = copy(item.bodies[e]);
+            variant.bodyLen = item.bodies[e].size();
+        }
+        bundle->paths_.push_back(item.path);
+        bundle->assets_.push_back(asset);
+    }
+    bundle->arenaUsed_ = pos - bundle->arena_;
+    // Read-only from now on, a stray write faults instead of corrupting
+    mprotect(bundle->arena_, bundle->arenaSize_, PROT_READ);
+
+    if (!bundle->BuildIndex_()) {
+        LOG_ERROR("StaticBundle perfect hash failed");
+        return nullptr;
+    }
+    return bundle;
+}
+
+bool StaticBundle::BuildIndex_() {
+    size_t n = paths_.size();
+    size_t bucketNum = n / 4 + 1;
+    vector<uint64_t> hashes(n);
+    vector<vector<uint32_t>> buckets(bucketNum);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = Hash_(paths_[i].data(), paths_[i].size());
+        buckets[Bucket(hashes[i], bucketNum)].push_back(i);
+    }
+    // Place the largest buckets first, while the table is empty
+    vector<uint32_t> order(bucketNum);
+    for (size_t b = 0; b < bucketNum; b++) {
+        order[b] = b;
+    }
+    sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    // Load factor ~0.8, grow the table if a bucket finds no displacement
+    for (slotNum_ = n + n / 4 + 1; slotNum_ < 4 * n + 16; slotNum_ *= 2) {
+        disp_.assign(bucketNum, 0);
+        slots_.assign(slotNum_, EMPTY_SLOT);
+        bool ok = true;
+        for (uint32_t b : order) {
+            const vector<uint32_t> &keys = buckets[b];
+            if (keys.empty()) {
+                break;
+            }
+            bool placed = false;
+            for (uint64_t d = 0; d < slotNum_ * slotNum_ && !placed; d++) {
+                vector<size_t> taken;
+                for (uint32_t key : keys) {
+                    size_t slot = Slot_(hashes[key], d);
+                    if (slots_[slot] != EMPTY_SLOT ||
+                        find(taken.begin(), taken.end(), slot) != taken.end()) {
+                        break;
+                    }
+                    taken.push_back(slot);
+                }
+                if (taken.size() == keys.size()) {
+                    for (size_t k = 0; k < keys.size(); k++) {
+                        slots_[taken[k]] = keys[k];
+                    }
+                    disp_[b] = static_cast<uint32_t>(d);
+                    placed = true;
+                }
+            }
+            if (!placed) {
+                ok = false;
+                break;
+            }
+        }
+        if (ok) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t StaticBundle::Hash_(const char *s, size_t len) {
+    // FNV-1a with a murmur3 finalizer, so both 32-bit halves are usable
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ static_cast<unsigned char>(s[i])) * 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+const StaticBundle::Asset *StaticBundle::Find(const string &path) const {
+    if (assets_.empty()) {
+        return nullptr;
+    }
+    uint64_t h = Hash_(path.data(), path.size());
+    uint32_t index = slots_[Slot_(h, disp_[Bucket(h, disp_.size())])];
+    if (index == EMPTY_SLOT || paths_[index] != path) {
+        return nullptr;
+    }
+    return &assets_[index];
+}
+
+shared_ptr<const StaticBundle> StaticBundle::Current() {
+    // Per thread copy, the shared pointer is only reloaded after a Swap()
+    thread_local uint64_t generation = 0;
+    thread_local shared_ptr<const StaticBundle> bundle;
+    uint64_t now = generation_.load(memory_order_acquire);
+    if (now != generation) {
+        bundle = atomic_load(&current_);
+        generation = now;
+    }
+    return bundle;
+}
+
+void StaticBundle::Swap(shared_ptr<const StaticBundle> bundle) {
+    atomic_store(&current_, move(bundle));
+    generation_.fetch_add(1, memory_order_release);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <mutex>
 #include <queue>
 #include <thread>
@@ -8,16 +9,78 @@
 
 class ThreadPool {
 public:
-    explicit ThreadPool(size_t threadNum=-1) : pool_(std::make_shared<Pool>()) {
+    // maxTasks bounds the queue for TryAddTask(), 0 leaves it unbounded.
+    // onStart runs first thing in every new worker with its number.
+    explicit ThreadPool(size_t threadNum=-1, size_t maxTasks=0,
+                        std::function<void(size_t)> onStart=nullptr)
+        : pool_(std::make_shared<Pool>()) {
+        pool_->maxTasks = maxTasks;
+        pool_->onStart = std::move(onStart);
+        Resize(threadNum);
+    }
+    ThreadPool() = default;
+    ThreadPool(ThreadPool &&) = default;
+    ~ThreadPool() {
+        if (static_cast<bool>(pool_)) {
+            {
+                std::scoped_lock<std::mutex> locker(pool_->mtx);
+                pool_->isStop = true;
+            }
+            pool_->cond.notify_all();
+        }
+    }
+
+    template<class T>
+    void AddTask(T&& task) {
+        {
+            std::scoped_lock<std::mutex> locker(pool_->mtx);
+            pool_->tasks.emplace(std::forward<T>(task));
+        }
+        pool_->cond.notify_one();
+    }
+
+    // false, and task untouched, if the queue is full
+    template<class T>
+    bool TryAddTask(T&& task) {
+        {
+            std::scoped_lock<std::mutex> locker(pool_->mtx);
+            if (pool_->maxTasks && pool_->tasks.size() >= pool_->maxTasks) {
+                return false;
+            }
+            pool_->tasks.emplace(std::forward<T>(task));
+        }
+        pool_->cond.notify_one();
+        return true;
+    }
+
+    // Start or retire workers, a retiring one finishes its task first
+    void Resize(size_t threadNum) {
         if (threadNum <= 0) {
             threadNum = std::thread::hardware_concurrency() + 1;
         }
-        for (int i = 0; i < threadNum; i++) {
+        std::scoped_lock<std::mutex> locker(pool_->mtx);
+        size_t live = pool_->threads - pool_->retire;
+        if (threadNum < live) {
+            pool_->retire += live - threadNum;
+            pool_->cond.notify_all();
+            return;
+        }
+        size_t more = threadNum - live;
+        size_t kept = std::min(pool_->retire, more);
+        pool_->retire -= kept;
+        for (size_t i = kept; i < more; i++) {
             // Create work thread
-            std::thread([pool = pool_] {
+            std::thread([pool = pool_, index = pool_->started++] {
+                if (pool->onStart) {
+                    pool->onStart(index);
+                }
                 std::unique_lock<std::mutex> locker(pool->mtx);
                 while (1) {
-                    if (pool->tasks.size()) {
+                    if (pool->retire) {
+                        pool->retire--;
+                        pool->threads--;
+                        break;
+                    } else if (pool->tasks.size()) {
                         auto task = std::move(pool->tasks.front());
                         pool->tasks.pop();
                         locker.unlock();
@@ -30,27 +93,13 @@ public:
                     }
                 }
             }).detach();
-        }
-    }
-    ThreadPool() = default;
-    ThreadPool(ThreadPool &&) = default;
-    ~ThreadPool() {
-        if (static_cast<bool>(pool_)) {
-            {
-                std::scoped_lock<std::mutex> locker(pool_->mtx);
-                pool_->isStop = true;
-            }
-            pool_->cond.notify_all();
+            pool_->threads++;
         }
     }
 
-    template<class T>
-    void AddTask(T&& task) {
-        {
-            std::scoped_lock<std::mutex> locker(pool_->mtx);
-            pool_->tasks.emplace(std::forward<T>(task));
-        }
-        pool_->cond.notify_one();
+    void SetMaxTasks(size_t maxTasks) {
+        std::scoped_lock<std::mutex> locker(pool_->mtx);
+        pool_->maxTasks = maxTasks;
     }
 
 private:
@@ -59,6 +108,11 @@ private:
         std::mutex mtx;
         std::condition_variable cond;
         std::queue<std::function<void()>> tasks;
+        size_t maxTasks{0};
+        size_t threads{0};
+        size_t retire{0};  // Workers asked to exit
+        size_t started{0};
+        std::function<void(size_t)> onStart;
     };
     std::shared_ptr<Pool> pool_;
 };
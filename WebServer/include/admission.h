@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <netinet/in.h>
+
+/**
+ * @brief Overload protection in front of the ThreadPool.
+ * Connections are counted at accept, in total and per source IP, and the
+ * ones over a cap are answered with a prebuilt 503 and closed. Requests are
+ * shed the same way while the pool is overloaded: CoDel-style, when the
+ * queueing delay of every task stayed above target for a whole interval,
+ * or when the bounded task queue is full. Only requests at a request
+ * boundary are shed, never a body or response in flight.
+ */
+class Admission {
+public:
+    static Admission *Instance();
+
+    // maxConn / perIpConn <= 0 disable the cap, targetMS <= 0 disables
+    // shedding on queueing delay. Called again from the event loop to
+    // change the limits live.
+    void Init(int maxConn, int perIpConn, int targetMS, int intervalMS,
+              int retryAfterS);
+
+    // Counts the connection, false if it is over a cap (not counted)
+    bool Admit(in_addr_t ip);
+    void Leave(in_addr_t ip);
+
+    // Queueing delay of a task as it starts, from any worker
+    void Observe(int64_t sojournUs, int64_t nowUs);
+    // Delay above target for an interval, and measured recently
+    bool IsOverloaded(int64_t nowUs) const;
+
+    // Best effort 503, the caller closes fd afterwards
+    void Reject(int fd) const;
+
+    int Connections() const { return conns_.load(std::memory_order_relaxed); }
+
+private:
+    Admission() = default;
+    ~Admission() = default;
+
+    std::atomic<int> maxConn_{0};
+    std::atomic<int> perIpConn_{0};
+    std::atomic<int64_t> targetUs_{0};
+    std::atomic<int64_t> intervalUs_{100000};
+    std::string reply_;  // Event loop only
+
+    std::atomic<int> conns_{0};
+    std::mutex mtx_;
+    std::unordered_map<in_addr_t, int> perIp_;  // Only with perIpConn_ > 0
+
+    // CoDel state, workers race on it, an occasional lost update only
+    // delays the switch by one task
+    std::atomic<int64_t> firstAbove_{0};  // When delay went above target
+    std::atomic<int64_t> lastObserve_{0};
+    std::atomic<bool> isDropping_{false};
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @brief Thread placement and naming. The kernel puts a page on the NUMA
+ * node of the thread that first touches it, so a thread pinned before it
+ * allocates keeps its buffers node-local without libnuma.
+ */
+class Affinity {
+public:
+    // "0-3,8" as for taskset -c, empty is no cores. false if malformed.
+    static bool Parse(const std::string &list, std::vector<int> &cores) {
+        cores.clear();
+        size_t pos = 0;
+        while (pos < list.size()) {
+            int first, last;
+            if (!Number_(list, pos, first)) {
+                return false;
+            }
+            last = first;
+            if (pos < list.size() && list[pos] == '-' &&
+                (!Number_(list, ++pos, last) || last < first)) {
+                return false;
+            }
+            for (int core = first; core <= last; core++) {
+                cores.push_back(core);
+            }
+            if (pos < list.size() && list[pos++] != ',') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Restrict thread to cores, an empty list leaves it as it is
+    static bool Pin(pthread_t thread, const std::vector<int> &cores) {
+        if (cores.empty()) {
+            return true;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int core : cores) {
+            if (core >= CPU_SETSIZE) {
+                return false;
+            }
+            CPU_SET(core, &set);
+        }
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    static bool Pin(const std::vector<int> &cores) {
+        return Pin(pthread_self(), cores);
+    }
+
+    // Shown by top -H, perf and gdb, cut to 15 characters
+    static void SetName(const std::string &name) {
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    }
+
+    // For logs, "any" for no cores
+    static std::string Format(const std::vector<int> &cores) {
+        std::string out;
+        for (int core : cores) {
+            out += (out.empty() ? "" : ",") + std::to_string(core);
+        }
+        return out.empty() ? "any" : out;
+    }
+
+    // NUMA node of a core, -1 if unknown
+    static int NodeOf(int core) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", core);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            return -1;
+        }
+        int node = -1;
+        while (struct dirent *entry = readdir(dir)) {
+            if (sscanf(entry->d_name, "node%d", &node) == 1) {
+                break;
+            }
+            node = -1;
+        }
+        closedir(dir);
+        return node;
+    }
+
+private:
+    static bool Number_(const std::string &list, size_t &pos, int &value) {
+        size_t start = pos;
+        value = 0;
+        while (pos < list.size() && isdigit(list[pos]) && pos - start < 6) {
+            value = value * 10 + (list[pos++] - '0');
+        }
+        return pos > start;
+    }
+};
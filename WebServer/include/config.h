@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Typed contents of config.json. Missing keys keep the defaults
+ * below, present ones are type and range checked. The server reloads the
+ * file on SIGHUP or when it changes; keys that cannot change while running
+ * are kept at their old value by KeepRestartOnly().
+ */
+struct Config {
+    struct Sql {
+        int port{3066};
+        std::string user{"root"};
+        std::string password{"root"};
+        std::string database{"Webserver"};
+        int poolNum{10};
+        int poolMax{32};
+        int waitMS{500};
+        int idleMS{60000};
+        int registerWindowMS{5};
+        int registerBatch{64};
+    };
+    struct UserCache {
+        int capacity{4096};
+        int ttlMS{60000};
+    };
+    struct Trace {
+        double sampleRate{0};
+        int ringSize{4096};
+        std::string path{"/trace"};
+    };
+    struct StaticBundle {
+        bool enable{true};
+        int maxFileSize{1 << 20};
+    };
+    struct Tcp {
+        bool noDelay{true};
+        int deferAcceptS{5};
+        int fastOpenQueue{256};
+    };
+    struct Admission {
+        int maxConn{65536};
+        int perIpConn{0};  // 0: no per IP cap
+        int maxQueue{4096};
+        int targetMS{10};
+        int intervalMS{100};
+        int retryAfterS{1};
+    };
+    struct RateLimit {
+        double requests{0};
+        int requestBurst{100};
+        double bytes{0};
+        int byteBurst{16 << 20};
+    };
+    struct Blocking {
+        int threadNum{4};  // 0 runs blocking routes on the I/O workers
+        int maxQueue{1024};
+    };
+    struct Cpu {
+        std::vector<int> reactor;  // Empty leaves a thread unpinned
+        std::vector<int> workers;  // One core per worker, round robin
+        std::vector<int> log;
+    };
+
+    std::string path;  // File it was loaded from
+    int port{8088};
+    int triggerMode{3};
+    bool isArmedET{false};
+    bool isOpenLinger{false};
+    int timeoutMS{-1};  // <= 0 disables all connection timers
+    int headerTimeoutMS{10000};
+    int writeTimeoutMS{30000};
+    int drainTimeoutMS{30000};
+    int maxBodySize{1 << 20};
+    int threadNum{13};
+    int acceptBatch{64};
+    bool isOpenLog{true};
+    int logLevel{0};
+    int logQueueSize{10};
+    std::string metricsPath{"/metrics"};
+    Sql sql;
+    UserCache userCache;
+    Trace trace;
+    StaticBundle staticBundle;
+    Tcp tcp;
+    Admission admission;
+    RateLimit rateLimit;
+    Blocking blocking;
+    Cpu cpu;
+
+    // false with the offending key in error if the file is unreadable or
+    // a value has the wrong type or range
+    static bool Load(const std::string &path, Config &config,
+                     std::string &error);
+    // Put back the running value of keys that only apply on a restart,
+    // returns the names of those that differed
+    static std::vector<std::string> KeepRestartOnly(const Config &running,
+                                                    Config &next);
+};
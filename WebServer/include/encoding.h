@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+/**
+ * @brief Content-Encoding negotiation and the compressors behind it.
+ * Static assets are compressed once (StaticBundle, or .gz/.br siblings
+ * produced by a build step), small dynamic bodies on the fly.
+ */
+class Encoding {
+public:
+    enum TYPE {
+        IDENTITY,
+        GZIP,
+        BROTLI,
+        TYPE_NUM
+    };
+
+    // Bodies below this are not worth a Content-Encoding header
+    static constexpr size_t MIN_SIZE = 256;
+
+    /**
+     * @brief Best encoding from an Accept-Encoding value
+     * @param available Bit mask of 1 << TYPE the response can be sent in
+     * Highest q wins, brotli before gzip on a tie. Identity is the fallback
+     * unless explicitly refused, which this server ignores.
+     */
+    static TYPE Negotiate(const std::string &acceptEncoding,
+                          unsigned available);
+
+    static const char *Name(TYPE type);
+    // File name suffix of a precompressed sibling, ".gz" / ".br"
+    static const char *Suffix(TYPE type);
+    // Text-like Content-type values
+    static bool IsCompressible(const std::string &contentType);
+
+    // false on failure, out is replaced
+    static bool Compress(TYPE type, const char *data, size_t len,
+                         std::string &out, bool best=false);
+};
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string_view>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
 
 #include "buffer.h"
 
@@ -10,7 +14,11 @@ public:
     enum PARSE_STATE {
         REQUEST_LINE,
         HEADER,
-        BODY,
+        BODY,           // Content-Length body
+        CHUNK_SIZE,     // Transfer-Encoding: chunked
+        CHUNK_DATA,
+        CHUNK_END,      // CRLF after the chunk data
+        TRAILER,
         FINISH
     };
     enum HTTP_CODE {
@@ -21,14 +29,75 @@ public:
         FORBIDDENT_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        TOO_LARGE_REQUEST
     };
 
-    HttpRequest() {}
+    // One spec of a Range header: first-last, first- (last == -1) or a
+    // suffix -last (first == -1). Resolved against the size by HttpResponse.
+    struct ByteRange {
+        int64_t first;
+        int64_t last;
+    };
+    static constexpr size_t MAX_RANGES = 16;
+
+    // Headers the server looks at, interned while parsing
+    enum HEADER_FIELD {
+        CONNECTION,
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        HOST,
+        IF_NONE_MATCH,
+        IF_RANGE,
+        RANGE,
+        ACCEPT_ENCODING,
+        TRANSFER_ENCODING,
+        EXPECT,
+        HEADER_NUM
+    };
+    // More header lines are rejected
+    static constexpr size_t MAX_HEADERS = 64;
+
+    // Receives the decoded body piece by piece, false rejects the request
+    using BodyCallback = std::function<bool(const char *data, size_t len)>;
+    // Called once the headers are parsed, may install a BodyCallback
+    using HeaderCallback = std::function<void(HttpRequest &request)>;
+
+    // Longest request line or header line
+    static constexpr size_t MAX_LINE = 8192;
+    // Limit of a body buffered in memory, 413 above it. Bodies that go to
+    // a BodyCallback (Router::AddUpload) are not limited here.
+    static std::atomic<size_t> maxBodySize;  // Changed on config reload
+
+    HttpRequest() { Init(); }
     ~HttpRequest() = default;
 
     void Init();
-    bool parse(Buffer& buff);
+    /**
+     * @brief Consume what buff holds of the current request
+     * Returns NO_REQUEST until the request is complete, then GET_REQUEST.
+     * Bytes of a following (pipelined) request stay in buff. After
+     * BAD_REQUEST or TOO_LARGE_REQUEST the connection cannot be reused.
+     */
+    HTTP_CODE parse(Buffer& buff);
+    // Part of a request consumed, the rest not received yet
+    bool InProgress() const {
+        return state_ != REQUEST_LINE && state_ != FINISH;
+    }
+    bool InBody() const {
+        return state_ != REQUEST_LINE && state_ != HEADER && state_ != FINISH;
+    }
+
+    // Once per request: the client waits for "100 Continue" before the body
+    bool TakeExpectContinue() {
+        bool expect = expectContinue_;
+        expectContinue_ = false;
+        return expect;
+    }
+
+    void SetHeaderCallback(HeaderCallback cb) { onHeader_ = std::move(cb); }
+    // Only for the current request, Init() clears it
+    void SetBodyCallback(BodyCallback cb) { onBody_ = std::move(cb); }
 
     bool IsKeepAlive() const;
     std::string path() const;
@@ -36,25 +105,61 @@ public:
     std::string method() const;
     std::string version() const;
     std::string GetPostValueByKey(const std::string &key) const;
+    // Value of a well-known header, O(1), empty if absent. Valid until the
+    // next request is parsed.
+    std::string_view Header(HEADER_FIELD id) const {
+        return known_[id] < 0 ? std::string_view() : Value_(fields_[known_[id]]);
+    }
+    // Any header by case-insensitive name, "" if absent
+    std::string GetHeader(const std::string &key) const;
+    // Specs of "Range: bytes=...", false if absent or malformed (then the
+    // header is ignored), or with more than MAX_RANGES specs
+    bool GetRanges(std::vector<ByteRange> &ranges) const;
+
+    // Login (isLogin) or register against the user table, blocks on MySQL
+    static bool UserVerify(const std::string &name, const std::string &pwd, bool isLogin);
 
 private:
     bool ParseRequestLine_(const std::string &line);
-    void ParseHeader_(const std::string &line);
-    void ParseBody_(const std::string &line);
+    bool ParseHeader_(std::string_view line);
+    // Pick the body framing once the headers are complete
+    HTTP_CODE ParseFraming_();
+    bool ParseChunkSize_(std::string_view line);
+    HTTP_CODE AppendBody_(const char *data, size_t len);
 
-    void ParsePath_();
     void ParsePost_();
     void ParseFromURLencoded_();
     void ParseKeyValue_(const std::string &line);
 
-    static bool UserVerify(const std::string &name, const std::string &pwd, bool isLogin);
+    static bool Register_(const std::string &name, const std::string &pwd);
 
     PARSE_STATE state_; // ¼ǰ״̬
     std::string method_{}, path_{}, version_{}, body_{};
-    std::unordered_map<std::string, std::string> header_{};
-    std::unordered_map<std::string, std::string> post_{};
+    size_t bodyLeft_{0};   // Of the Content-Length body or current chunk
+    size_t bodySize_{0};
+    bool expectContinue_{false};
+    HeaderCallback onHeader_;
+    BodyCallback onBody_;
+
+    // Header lines of the request are copied into headerData_ (the read
+    // buffer moves between reads) and the fields point into it. Both keep
+    // their memory across requests.
+    struct Field {
+        int id;  // HEADER_FIELD, -1 for the others
+        uint32_t nameOff, nameLen;
+        uint32_t valueOff, valueLen;
+    };
+    std::string_view Value_(const Field &field) const {
+        return std::string_view(headerData_.data() + field.valueOff,
+                                field.valueLen);
+    }
+    static int HeaderId_(std::string_view name);
+
+    std::string headerData_;
+    Field fields_[MAX_HEADERS];
+    size_t fieldNum_{0};
+    int known_[HEADER_NUM];  // Index into fields_, -1 if absent
+    std::vector<std::pair<std::string, std::string>> post_;
 
-    static const std::unordered_set<std::string> DEFAULT_HTML;
-    static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG;
     static int ConvertHex(char ch);
 };
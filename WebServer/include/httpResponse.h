@@ -1,32 +1,98 @@
 #pragma once
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "buffer.h"
+#include "encoding.h"
+#include "httpRequest.h"
 
 class HttpResponse {
 public:
+    /**
+     * @brief Producer of a streamed body
+     * Called each time the previous piece has been written out. Appends the
+     * next piece (about `want` bytes) to out and returns false once the body
+     * is complete, out may still carry a last piece then. It must append
+     * something whenever it returns true.
+     */
+    using StreamSource = std::function<bool(std::string &out, size_t want)>;
+    // Bytes asked from a StreamSource per piece, the per-response footprint
+    static constexpr size_t STREAM_PIECE = 16 * 1024;
+
     HttpResponse();
     ~HttpResponse();
 
     void Init(const std::string& srcDir, std::string& path,
-                bool isKeepAlive=false, int code=-1);
+                bool isKeepAlive=false, int code=-1,
+                const std::string &acceptEncoding="");
+    // Serve the file as 206 if it is still the representation If-Range
+    // names (or If-Range is empty), call after Init()
+    void SetRanges(const std::vector<HttpRequest::ByteRange> &ranges,
+                   const std::string &ifRange);
     void MakeResponse(Buffer &buff);
+    // Response with an in-memory body instead of a file under srcDir
+    void MakeResponse(Buffer &buff, const std::string &type,
+                      const std::string &body);
+    /**
+     * @brief Response whose body is produced while it is sent
+     * Sent with Transfer-Encoding: chunked, or delimited by closing the
+     * connection if the client cannot take chunks (HTTP/1.0). Pieces are
+     * pulled by NextPiece() as the socket drains.
+     */
+    void MakeStream(Buffer &buff, const std::string &type, StreamSource source,
+                    bool isChunked);
+    bool IsStreaming() const { return static_cast<bool>(source_); }
+    // Append the next framed piece (and the last-chunk after the final one)
+    // to buff, false if the stream has ended
+    bool NextPiece(Buffer &buff);
+    // Drop an unfinished stream, e.g. when the connection closes
+    void CancelStream() { source_ = nullptr; }
     void UnmapFile();
     char* File();
     size_t FileLen() const;
+    // Pieces of the file response body to writev() after the header:
+    // the mapped file, a slice of it, or multipart/byteranges parts
+    const std::vector<struct iovec>& Body() const { return body_; }
     void ErrorContent(Buffer& buff, std::string message);
     int Code() const { return code_; }
+    // Content-type for path by its suffix
+    static std::string FileType(const std::string &path);
+    // Strong validator of a file (variant), quoted
+    static std::string ETag(const struct stat &st,
+                            Encoding::TYPE encoding=Encoding::IDENTITY);
 
 private:
     void AddStateLine_(Buffer &buff);
-    void AddHeader_(Buffer &buff);
-    void AddContent_(Buffer &buff);
+    void AddHeader_(Buffer &buff, const std::string &type);
+    void AddContent_(Buffer &buff, const std::string &type);
 
     void ErrorHtml_();
+    // Switch to a .br/.gz sibling of the file if the client takes one
+    void NegotiateFile_();
+    // Satisfiable ranges of the file into ranges_, sets 206 or 416
+    void ResolveRanges_();
     std::string GetFileType_();
 
     int code_;
     bool isKeepAlive_;
+    std::string acceptEncoding_;
+    Encoding::TYPE encoding_;
+    bool isVary_;
+    std::string etag_;  // Set for 200/206 file responses
+
+    std::vector<HttpRequest::ByteRange> rangeSpecs_;
+    std::string ifRange_;
+    std::vector<std::pair<size_t, size_t>> ranges_;  // offset, length
+    std::string parts_;  // multipart/byteranges part headers
+    std::vector<struct iovec> body_;
+
+    StreamSource source_;
+    bool isChunked_;
+    std::string piece_;  // Reused between pieces
 
     std::string path_;
     std::string srcDir_;
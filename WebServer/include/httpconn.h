@@ -1,11 +1,22 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 
 #include "log.h"
 #include "buffer.h"
 #include "httpRequest.h"
 #include "httpResponse.h"
+#include "quadheaptimer.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "staticbundle.h"
+#include "router.h"
+#include "ratelimiter.h"
 
 class HttpConn {
 public:
@@ -15,42 +26,176 @@ public:
     void Init(int sockFd, const sockaddr_in &addr);
     ssize_t read(int *saveErrno);
     ssize_t write(int *saveErrno);
-    void Close();
+    // true if this call closed the socket
+    bool Close();
     // Process HTTP connections, the logic is to parse the request and generate
     // the response
     bool Handle();
 
+    // Handle() stopped at a blocking route. The connection stays owned
+    // until RunOffloaded() (or RejectOffload()) is done, then the next
+    // Handle() builds the response.
+    bool IsOffloaded() const { return offload_ == OFFLOAD_PENDING; }
+    // Run the route's handler, on any thread
+    void RunOffloaded();
+    // Answer 503 instead, when the blocking pool is full
+    void RejectOffload();
+
     // Interface to get connection information
     int GetFd() const;
     int GetPort() const;
     const char* GetIP() const;
     sockaddr_in GetAddr() const;
 
-    // The amount of data that needs to be written
-    int ToWriteBytes() {
-        return iov_[0].iov_len + iov_[1].iov_len;
+    // The amount of data that needs to be written. For a streamed response
+    // it only drops to 0 after the last piece.
+    size_t ToWriteBytes() const {
+        return toWrite_;
     }
 
+    // Of the last response, false after a request that was rejected
     bool IsKeepAlive() const {
-        return request_.IsKeepAlive();
+        return isKeepAlive_;
+    }
+
+    // Timeout bookkeeping. Deadlines are ms on QuadHeapTimer::Clock, written
+    // by whichever thread owns the connection and checked by the event loop
+    // when the connection's timer fires, so refreshing one is a single store.
+    enum TIMEOUT {
+        HEADER_TIMEOUT,  // Request not complete since RequestStart()
+        IDLE_TIMEOUT,    // Keep-alive connection waiting for next request
+        WRITE_TIMEOUT,   // Response pending, peer not reading
+        BODY_TIMEOUT     // Request body pending, peer not sending
+    };
+    static constexpr int64_t NO_DEADLINE = -1;        // Closed, drop timer
+    static constexpr int64_t BUSY = INT64_MAX;        // Owned by a worker
+    static constexpr int64_t NEVER = INT64_MAX - 1;   // Timeouts disabled
+
+    // Phase while waiting for more of the request
+    TIMEOUT ReadPhase() const {
+        if (request_.InBody()) {
+            return BODY_TIMEOUT;
+        }
+        return request_.InProgress() || readBuff_.ReadableBytes()
+                   ? HEADER_TIMEOUT : IDLE_TIMEOUT;
+    }
+
+    TraceSpan& Trace() { return trace_; }
+
+    // Armed ET mode: the fd stays registered for EPOLLIN | EPOLLOUT and is
+    // never re-armed. One worker owns the connection and drives it until
+    // the socket blocks, events the loop sees meanwhile wait in pending_.
+    // Post() returns true if the caller became the owner.
+    bool Post(uint32_t events) {
+        pending_.fetch_or(events);
+        return TryOwn();
+    }
+    bool TryOwn() {
+        bool expected = false;
+        return owned_.compare_exchange_strong(expected, true);
+    }
+    uint32_t TakeEvents() {
+        uint32_t events = pending_.exchange(0);
+        canRead_ = canRead_ || (events & EPOLLIN);
+        canWrite_ = canWrite_ || (events & EPOLLOUT);
+        return events;
+    }
+    // false if events arrived meanwhile and the caller still owns it
+    bool Release() {
+        owned_.store(false);
+        return pending_.load() == 0 || !TryOwn();
     }
+    // Readiness not yet used up: ET only reports transitions, so this is
+    // cleared when a read or write hits EAGAIN
+    bool CanRead() const { return canRead_; }
+    bool CanWrite() const { return canWrite_; }
+
+    TimerHook* Timer() { return &timer_; }
+    void SetDeadline(int64_t deadline, TIMEOUT phase) {
+        SetIdle_(phase == IDLE_TIMEOUT);
+        phase_.store(phase, std::memory_order_relaxed);
+        deadline_.store(deadline, std::memory_order_release);
+    }
+    void SetBusy() { deadline_.store(BUSY, std::memory_order_release); }
+    int64_t Deadline() const {
+        return deadline_.load(std::memory_order_acquire);
+    }
+    TIMEOUT Phase() const { return phase_.load(std::memory_order_relaxed); }
+    int64_t RequestStart() const { return reqStart_; }
+    void SetRequestStart(int64_t start) { reqStart_ = start; }
+
+    // An ET read stops here, the rest is read after parsing made room.
+    // Re-arming the fd reports the unread data again.
+    static constexpr size_t READ_LIMIT = 64 * 1024;
 
     static bool isET;
+    // Leave blocking routes to the caller of Handle(), see IsOffloaded()
+    static bool isOffload;
+    // Set when the server drains, every response after it closes
+    static std::atomic<bool> isDraining;
     static const char* srcDir;
     static std::atomic<int> userCount; // The number of all HTTP connections
 
 private:
+    enum OFFLOAD {
+        OFFLOAD_NONE,
+        OFFLOAD_PENDING,  // Blocking handler not run yet
+        OFFLOAD_DONE      // reply_ filled in, response not built
+    };
+
+    // Queue the next piece of a streamed response once the last is written
+    bool NextPiece_();
+    // Installs the body callback of an upload route
+    void OnHeader_(HttpRequest &request);
+    // The matched route's handler, or the onDone of its upload
+    void Run_();
+    // Build the response to the parsed request from reply_
+    void Respond_(HttpRequest::HTTP_CODE code, bool isLimited,
+                  Router::RESULT routed, int64_t start);
+
+    // Keeps the CONN_IDLE gauge, only the owning thread calls it
+    void SetIdle_(bool idle) {
+        if (idle != isIdle_) {
+            isIdle_ = idle;
+            Metrics::Instance()->Add(Metrics::CONN_IDLE, idle ? 1 : -1);
+        }
+    }
+
     int fd_;         // Descriptor for HTTP connection
     bool isClose_;
+    bool isKeepAlive_{false};
 
     struct sockaddr_in addr_;
 
-    int iovCnt_;
-    struct iovec iov_[2];  // for writev(), centralized output
+    // for writev(), centralized output: iov_[0] is writeBuff_, then the body
+    // pieces. Entries before iovIdx_ are fully written.
+    std::vector<struct iovec> iov_;
+    size_t iovIdx_{0};
+    size_t toWrite_{0};
+    uint64_t bytes_{0};  // Read and written since the last rate check
     // Read and write buffer
     Buffer readBuff_;
     Buffer writeBuff_;
 
     HttpRequest request_;
     HttpResponse response_;
+    Router::Params params_;  // Of the matched route, reused
+    const Router::Route *route_{nullptr};
+    Router::Reply reply_;
+    Router::Upload upload_;  // Of the request being read
+    OFFLOAD offload_{OFFLOAD_NONE};
+
+    TimerHook timer_;  // ctx points back to this connection
+    std::atomic<int64_t> deadline_{NO_DEADLINE};
+    std::atomic<TIMEOUT> phase_{IDLE_TIMEOUT};
+    int64_t reqStart_{0};
+    bool isIdle_{false};
+    std::atomic<bool> owned_{false};
+    std::atomic<uint32_t> pending_{0};
+    bool canRead_{false};
+    bool canWrite_{true};
+    int64_t writeStart_{0};  // us when the response was built, 0 if none
+    TraceSpan trace_;
+    // Pins the bundle the response is written from across a reload
+    std::shared_ptr<const StaticBundle> bundle_;
 };
@@ -3,6 +3,7 @@
 #include <mutex>
 #include <thread>
 #include <string>
+#include <vector>
 
 #include "buffer.h"
 #include "BlockDeque.hpp"
@@ -20,6 +21,8 @@ public:
     int GetLevel();
     void SetLevel(int level);
     bool IsOpen() { return isOpen_; }
+    // Restrict the async writer thread to cores, false without one
+    bool PinWriter(const std::vector<int> &cores);
 
 private:
     Log()=default;
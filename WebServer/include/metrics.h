@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Process wide counters, gauges and latency histograms.
+ * Every thread writes only its own cache-line aligned shard with relaxed
+ * single-writer stores, so the request path never contends on a shared
+ * line. Render() sums the shards on demand into Prometheus text format.
+ */
+class Metrics {
+public:
+    enum COUNTER {
+        ACCEPTED,       // Connections accepted
+        BYTES_IN,       // Bytes read from clients
+        BYTES_OUT,      // Bytes written to clients
+        TIMEOUTS,       // Connections closed by a timer
+        WRITE_DIRECT,   // Responses written right after being built
+        WRITE_DEFERRED, // Responses left to wait for EPOLLOUT
+        REJECTED,       // Connections refused at accept
+        SHED,           // Requests answered 503 under overload
+        OFFLOADED,      // Requests handed to the blocking pool
+        COUNTER_NUM
+    };
+
+    // Gauges are sums of per-thread deltas, so any thread may Add() +1/-1
+    enum GAUGE {
+        CONN_IDLE,      // Keep-alive connections waiting for a request
+        BLOCKING_QUEUED, // Tasks waiting for a blocking pool thread
+        GAUGE_NUM
+    };
+
+    enum HISTOGRAM {
+        QUEUE_WAIT,     // Event loop to ThreadPool worker
+        PARSE,          // HttpRequest::parse
+        BUILD,          // HttpResponse::MakeResponse
+        WRITE,          // Response built to last byte written
+        DB_WAIT,        // SqlConnPool::GetConn
+        BLOCKING_WAIT,  // Worker to blocking pool thread
+        BLOCKING_RUN,   // Blocking route handler
+        HISTOGRAM_NUM
+    };
+
+    // Power of two buckets, bucket i counts samples < 2^i us, the last one
+    // is the overflow bucket (>= ~8s)
+    static constexpr int BUCKET_NUM = 25;
+
+    static Metrics *Instance();
+
+    void Inc(COUNTER counter, uint64_t n=1) {
+        Bump_(LocalShard_().counters[counter], n);
+    }
+    void Add(GAUGE gauge, int64_t n) {
+        Bump_(LocalShard_().gauges[gauge], static_cast<uint64_t>(n));
+    }
+    void Status(int code) {
+        Bump_(LocalShard_().status[StatusIndex_(code)], 1);
+    }
+    void Observe(HISTOGRAM histogram, int64_t us);
+
+    // Extra text appended to Render(), for stats owned by other modules
+    void AddCollector(std::function<void(std::string&)> collector);
+    std::string Render();
+
+    static int64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Snapshots summed over all shards
+    uint64_t Get(COUNTER counter);
+    int64_t Get(GAUGE gauge);
+
+private:
+    Metrics() = default;
+    ~Metrics() = default;
+
+    static constexpr int STATUS_CODES[] = {
+        200, 206, 304, 400, 403, 404, 405, 413, 416, 429, 500, 503};
+    static constexpr int STATUS_NUM =
+        sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]) + 1;  // + other
+
+    struct Histogram {
+        std::atomic<uint64_t> buckets[BUCKET_NUM];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sumUs;
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[COUNTER_NUM];
+        std::atomic<uint64_t> gauges[GAUGE_NUM];
+        std::atomic<uint64_t> status[STATUS_NUM];
+        Histogram histograms[HISTOGRAM_NUM];
+    };
+
+    // Only the owning thread writes a shard, no read-modify-write needed
+    static void Bump_(std::atomic<uint64_t> &value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+    }
+    static int StatusIndex_(int code) {
+        for (int i = 0; i < STATUS_NUM - 1; i++) {
+            if (STATUS_CODES[i] == code) {
+                return i;
+            }
+        }
+        return STATUS_NUM - 1;
+    }
+
+    Shard &LocalShard_() {
+        thread_local Shard *shard = nullptr;
+        if (!shard) {
+            shard = NewShard_();
+        }
+        return *shard;
+    }
+    Shard *NewShard_();
+
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Shard>> shards_;  // Never freed
+    std::vector<std::function<void(std::string&)>> collectors_;
+};
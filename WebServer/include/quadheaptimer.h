@@ -0,0 +1,71 @@
+/**
+ * @file quadheaptimer.h
+ * @brief Intrusive 4-ary timer heap. The heap position lives in a TimerHook
+ * embedded in the timed object (e.g. HttpConn), so re-scheduling needs no
+ * hash lookup, and callbacks are a plain function pointer + context instead
+ * of a std::function. The four children of a node are contiguous, and
+ * the tree is half as deep as a binary heap's.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+typedef void (*TimerCallBack)(void *ctx);
+
+struct TimerHook {
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    size_t index{npos};       // Position in the heap, npos if not scheduled
+    TimerCallBack cb{nullptr};
+    void *ctx{nullptr};
+
+    bool linked() const { return index != npos; }
+};
+
+class QuadHeapTimer {
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::milliseconds MS;
+    typedef Clock::time_point TimeStamp;
+
+    QuadHeapTimer() { heap_.reserve(64); }
+    ~QuadHeapTimer() { clear(); }
+
+    // Schedule hook, or re-schedule it if already in the heap
+    void add(TimerHook *hook, int timeoutMS);
+    void add(TimerHook *hook, TimeStamp expires);
+    void adjust(TimerHook *hook, int timeoutMS) { add(hook, timeoutMS); }
+    void remove(TimerHook *hook);
+    // Pop every expired timer in one batch, then run their callbacks
+    size_t tick();
+    // Pop every expired timer into expired without running callbacks, for
+    // owners that dispatch the batch themselves through hook->ctx
+    size_t PopExpired(std::vector<TimerHook*> &expired);
+    // Milliseconds until the next expiry, -1 if there are no timers
+    int GetNextTick();
+    int NextTickMS() const;
+    void clear();
+
+    size_t size() const { return heap_.size(); }
+    bool empty() const { return heap_.empty(); }
+
+private:
+    struct Node {
+        TimeStamp expires;
+        TimerHook *hook;
+    };
+
+    static constexpr size_t D = 4;
+
+    void place_(size_t i, const Node &node);
+    void siftUp_(size_t i);
+    void siftDown_(size_t i);
+    void del_(size_t i);
+
+    std::vector<Node> heap_;
+    std::vector<TimerHook*> expired_;  // Reused by tick()
+};
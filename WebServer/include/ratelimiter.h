@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <netinet/in.h>
+
+/**
+ * @brief Per source IP token buckets, one for requests and one for bytes
+ * read and written. Checked once per parsed request, a client over either
+ * budget gets a bare 429 instead of a routed response. Bytes are
+ * charged after the fact, so the byte bucket may go into debt and blocks
+ * requests until it is refilled.
+ * The table is split into independently locked shards. A bucket idle long
+ * enough to be full again is the same as a new one, so Sweep() drops those,
+ * one shard per call, from the event loop's timer.
+ */
+class RateLimiter {
+public:
+    static RateLimiter *Instance();
+
+    // A rate <= 0 disables that bucket, both disable the limiter
+    void Init(double requestRate, double requestBurst, double byteRate,
+              double byteBurst, size_t shardNum=64);
+    // New rates for all clients, their tokens are kept
+    void Set(double requestRate, double requestBurst, double byteRate,
+             double byteBurst);
+
+    // Charge bytes moved since the last call and take one request token,
+    // false if the client is over its budget
+    bool Allow(in_addr_t ip, uint64_t bytes, int64_t nowUs);
+    // Charge bytes only, for what a closing connection moved last
+    void Charge(in_addr_t ip, uint64_t bytes, int64_t nowUs);
+    // The 429 response, headers only
+    std::string Reply(bool isKeepAlive) const;
+
+    // Expire the next shard, returns ms until it should be called again
+    int Sweep(int64_t nowUs);
+
+    bool IsOpen() const { return isOpen_; }
+    size_t Size() const;
+
+private:
+    RateLimiter() = default;
+    ~RateLimiter() = default;
+
+    struct Bucket {
+        double requests;
+        double bytes;
+        int64_t lastUs;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mtx;
+        std::unordered_map<in_addr_t, Bucket> buckets;
+    };
+
+    static void Refill_(double &tokens, double rate, double burst,
+                        int64_t elapsedUs);
+    // Refilled and charged bucket of ip, shard locked by the caller
+    Bucket &Take_(Shard &shard, in_addr_t ip, uint64_t bytes, int64_t nowUs);
+    Shard &ShardOf_(in_addr_t ip) const;
+
+    std::atomic<bool> isOpen_{false};
+    std::atomic<int> retryAfterS_{1};
+    // Read with any shard locked, Set() holds all of them
+    double requestRate_{0};  // Tokens per second
+    double requestBurst_{0};
+    double byteRate_{0};
+    double byteBurst_{0};
+    int64_t fullUs_{0};      // Time for an empty bucket to fill up
+
+    size_t shardNum_{0};     // Power of two
+    size_t sweepNext_{0};
+    std::unique_ptr<Shard[]> shards_;
+};
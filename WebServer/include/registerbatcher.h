@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sqlconnpool.h"
+
+/**
+ * @brief Write-behind stage for user registration.
+ * Register requests are collected for a short window (or until maxBatch
+ * entries are pending) and inserted with one multi-row INSERT inside a
+ * single transaction, so a sign-up burst costs one commit per batch
+ * instead of one per user. Each caller waits on its own future.
+ */
+class RegisterBatcher {
+public:
+    enum RESULT {
+        SUCCESS,
+        DUPLICATE,  // Username already taken
+        FAILED      // Database error or batcher closed
+    };
+
+    static RegisterBatcher *Instance();
+
+    // windowMS <= 0 or maxBatch <= 1 disables batching
+    void Init(SqlConnPool *connPool, int windowMS, int maxBatch=64);
+    void Close();
+    bool IsOpen() const { return isOpen_; }
+
+    std::future<RESULT> Submit(const std::string &name, const std::string &pwd);
+    // Insert a single user on the caller's connection, used when disabled
+    static RESULT InsertOne(MYSQL *sql, const std::string &name,
+                            const std::string &pwd);
+
+private:
+    struct Pending {
+        std::string name;
+        std::string pwd;
+        std::promise<RESULT> result;
+    };
+
+    RegisterBatcher() = default;
+    ~RegisterBatcher();
+
+    void Run_();
+    void Flush_(std::vector<Pending> &batch);
+    static std::string Escape_(MYSQL *sql, const std::string &str);
+
+    SqlConnPool *connPool_{nullptr};
+    int windowMS_{0};
+    size_t maxBatch_{0};
+    bool isOpen_{false};
+    bool isClose_{false};
+
+    std::vector<Pending> pending_;
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::thread worker_;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "httpRequest.h"
+#include "httpResponse.h"
+
+/**
+ * @brief Method + path dispatch, compiled into a radix trie at startup.
+ * Patterns are exact ("/login"), parametric ("/user/:id", one non-empty
+ * segment per parameter) or prefix, ending in '*' to take anything below
+ * the text before it. A lookup walks the trie once, O(path length), static
+ * edges before parameters and the longest prefix route last. Paths
+ * without a route fall back to the static files under srcDir.
+ * Routes are added before the server starts, lookups are read only.
+ */
+class Router {
+public:
+    enum METHOD {
+        GET,
+        HEAD,
+        POST,
+        PUT,
+        DELETE,
+        OPTIONS,
+        PATCH,
+        METHOD_NUM
+    };
+
+    using Params = std::vector<std::pair<std::string, std::string>>;
+
+    // What a handler answers with. By default the file at path is served
+    // (request path, or rewritten by the handler), a type makes it an
+    // in-memory body, a stream a streamed one.
+    struct Reply {
+        int code{-1};  // -1: 200, or what serving the file yields
+        std::string path;
+        std::string type;
+        std::string body;
+        HttpResponse::StreamSource stream;
+    };
+
+    // Runs on a worker thread, or the blocking pool for a blocking route,
+    // and only sees the request, so it may run anywhere the request is
+    // available
+    using Handler = std::function<void(const HttpRequest &request,
+                                       const Params &params, Reply &reply)>;
+
+    // Of a route that takes its body as it arrives. onBody gets the decoded
+    // body instead of it being buffered (and limited by maxBodySize), false
+    // rejects the request. onDone then answers like a Handler.
+    struct Upload {
+        HttpRequest::BodyCallback onBody;
+        Handler onDone;
+    };
+    // Makes the Upload of one request once its headers are parsed, on the
+    // I/O worker. Body pieces arrive there too.
+    using UploadHandler = std::function<Upload(const HttpRequest &request,
+                                               const Params &params)>;
+
+    struct Route {
+        METHOD method;
+        std::string pattern;
+        Handler handler;  // Unused for an upload route
+        bool isBlocking;  // Waits on I/O, run off the I/O workers
+        UploadHandler upload;
+    };
+
+    enum RESULT {
+        FOUND,
+        NOT_FOUND,    // Static fallback
+        NOT_ALLOWED   // Path has routes, none for the method (405)
+    };
+
+    static Router *Instance();
+
+    // false if the pattern is malformed or already taken. A blocking
+    // handler (database, disk) runs on the blocking pool.
+    bool Add(METHOD method, const std::string &pattern, Handler handler,
+             bool isBlocking=false);
+    // Route whose body is streamed to it, isBlocking applies to onDone
+    bool AddUpload(METHOD method, const std::string &pattern,
+                   UploadHandler upload, bool isBlocking=false);
+    // Serve file for GET path, e.g. "/login" -> "/login.html"
+    bool Alias(const std::string &path, const std::string &file);
+    void Clear();
+
+    // params are replaced, route is set when FOUND
+    RESULT Find(const std::string &method, const std::string &path,
+                const Route *&route, Params &params) const;
+
+    // -1 for methods the router does not know
+    static int MethodOf(const std::string &method);
+    // Value of a parameter, "" if absent
+    static std::string Param(const Params &params, const std::string &name);
+
+private:
+    Router() { Clear(); }
+    ~Router() = default;
+
+    struct Node {
+        std::string label;  // Edge from the parent, empty for parameters
+        std::vector<std::pair<char, int>> children;  // First byte, node
+        int param{-1};       // Child matching one segment
+        std::string paramName;
+        int exact[METHOD_NUM];
+        int prefix[METHOD_NUM];  // Routes ending in "*"
+    };
+
+    bool Add_(Route route);
+    int NewNode_(const std::string &label);
+    // Node reached by the static text, splitting edges as needed
+    int InsertStatic_(int node, const std::string &text);
+    int Match_(int node, const char *pos, const char *end, int method,
+               Params &params, bool &pathFound) const;
+    static bool HasAny_(const int *routes);
+
+    std::vector<Node> nodes_;  // nodes_[0] is the root
+    std::vector<Route> routes_;
+};
@@ -1,43 +1,104 @@
 #pragma once
 
 #include <mysql/mysql.h>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <string>
-#include <queue>
 #include <mutex>
-#include <semaphore.h>
+#include <thread>
+#include <vector>
 
 class SqlConnPool {
 public:
+    // Acquisition statistics, wait time is measured from GetConn() entry
+    struct Stats {
+        uint64_t acquired;
+        uint64_t timeouts;
+        uint64_t waitUs;     // Total time spent waiting for a connection
+        uint64_t maxWaitUs;
+        uint64_t reconnects;
+        int total;           // Open connections, idle and in use
+        int idle;
+    };
+
     // Get sql connection pool instance
     static SqlConnPool *Instance();
-    // Get connection from pool
-    MYSQL *GetConn();
+    // Get connection from pool, wait at most timeoutMS (-1: pool default)
+    // Return nullptr when no connection became available in time
+    MYSQL *GetConn(int timeoutMS=-1);
     void FreeConn(MYSQL *conn);
     int GetFreeConnCount() const; // Connection queue's size
+    int GetConnCount() const;     // All open connections
+    Stats GetStats() const;
 
     void Init(const char *host, int port,
             const char *user, const char *pwd,
-            const char *dbName, int connSize);
+            const char *dbName, int minConn, int maxConn=-1,
+            int waitTimeoutMS=500, int idleTimeoutMS=60000);
+    // New limits for a running pool, it grows and shrinks towards them
+    void Resize(int minConn, int maxConn, int waitTimeoutMS, int idleTimeoutMS);
     void ClosePool();
 
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct IdleConn {
+        MYSQL *sql;
+        Clock::time_point since;    // Time when returned to the pool
+        Clock::time_point checked;  // Last time known to be alive
+    };
+
     SqlConnPool() = default;
     ~SqlConnPool();
 
-    int MAX_CONN_;
-    int used_count_{0};
-    int free_count_{0};
+    MYSQL *Connect_();
+    // Background thread: shrink idle, ping and reconnect broken connections,
+    // connect what GetConn() asked for
+    void Maintain_();
+
+    // Connections idle longer than this are pinged before being handed out
+    static constexpr int VALIDATE_IDLE_MS = 3000;
+    // Idle connections are pinged in background at least this often
+    static constexpr int KEEPALIVE_MS = 30000;
+    static constexpr int MAINTAIN_INTERVAL_MS = 1000;
+    static constexpr unsigned int CONNECT_TIMEOUT_S = 3;
+    // Per read or write, the client retries a read up to three times
+    static constexpr unsigned int IO_TIMEOUT_S = 2;
+
+    std::string host_, user_, pwd_, dbName_;
+    int port_{0};
+
+    int MIN_CONN_{0};
+    int MAX_CONN_{0};
+    std::atomic<int> waitTimeoutMS_{0};  // Read without the lock
+    int idleTimeoutMS_{0};
+    int total_{0};       // Open + connecting connections
+    int growing_{0};     // Connections GetConn() asked the maintainer for
+    bool isClose_{true};
+
+    uint64_t acquired_{0};
+    uint64_t timeouts_{0};
+    uint64_t waitUs_{0};
+    uint64_t maxWaitUs_{0};
+    uint64_t reconnects_{0};
 
-    std::queue<MYSQL *> connQue_;  // Ready queue for MySql conn
+    std::deque<IdleConn> connQue_;  // Ready queue for MySql conn, back is hottest
+    std::vector<IdleConn> stale_;   // Idle too long, to be pinged first
     mutable std::mutex mtx_;
-    sem_t semId_;
+    std::condition_variable condConn_;
+    std::condition_variable condMaintain_;
+    std::thread maintainer_;
 };
 
 class SqlConnect {
 public:
-    SqlConnect(MYSQL **sql, SqlConnPool *connpool) {
+    SqlConnect(MYSQL **sql, SqlConnPool *connpool, int timeoutMS=-1) {
         assert(connpool);
-        *sql = connpool->GetConn();
+        *sql = connpool->GetConn(timeoutMS);
         sql_ = *sql;
         connpool_ = connpool;
     }
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "encoding.h"
+
+/**
+ * @brief Every file under srcDir preloaded into one arena, together with
+ * its full response headers (status, Connection, type, length, ETag) and
+ * gzip/brotli variants of text assets, indexed by a CHD perfect hash of the
+ * URL path. Serving an asset is one lookup, no stat/open/mmap.
+ * A bundle never changes after Build(). Reloading builds a new bundle and
+ * swaps it in, and connections still writing from the old one keep it
+ * alive through their shared_ptr.
+ */
+class StaticBundle {
+public:
+    struct Variant {
+        const char *header[2];  // [isKeepAlive]
+        size_t headerLen[2];
+        const char *body;
+        size_t bodyLen;
+    };
+
+    struct Asset {
+        Variant variants[Encoding::TYPE_NUM];
+        unsigned encodings;     // 1 << Encoding::TYPE of present variants
+        const Variant &Get(Encoding::TYPE type) const {
+            return variants[type];
+        }
+    };
+
+    ~StaticBundle();
+
+    // Files larger than maxFileSize are left to the mmap path.
+    // Returns nullptr if the arena cannot be allocated.
+    static std::shared_ptr<const StaticBundle> Build(const std::string &srcDir,
+                                                     size_t maxFileSize);
+
+    // The bundle currently served, nullptr if disabled
+    static std::shared_ptr<const StaticBundle> Current();
+    static void Swap(std::shared_ptr<const StaticBundle> bundle);
+
+    const Asset *Find(const std::string &path) const;
+
+    size_t Size() const { return assets_.size(); }
+    size_t Bytes() const { return arenaUsed_; }
+    bool IsHugePage() const { return isHugePage_; }
+
+private:
+    StaticBundle() = default;
+
+    static uint64_t Hash_(const char *s, size_t len);
+    // Hash and displace: bucket b moves its keys by disp_[b]
+    bool BuildIndex_();
+    size_t Slot_(uint64_t h, uint32_t disp) const {
+        uint64_t f1 = h % slotNum_, f2 = (h >> 32) % slotNum_;
+        uint64_t d0 = disp / slotNum_, d1 = disp % slotNum_;
+        return (f1 + d0 * f2 + d1) % slotNum_;
+    }
+
+    char *arena_{nullptr};
+    size_t arenaSize_{0};
+    size_t arenaUsed_{0};
+    bool isHugePage_{false};
+
+    std::vector<std::string> paths_;
+    std::vector<Asset> assets_;
+    std::vector<uint32_t> disp_;   // Per bucket displacement
+    std::vector<uint32_t> slots_;  // Slot -> asset index
+    size_t slotNum_{0};
+
+    static std::shared_ptr<const StaticBundle> current_;
+    static std::atomic<uint64_t> generation_;
+};
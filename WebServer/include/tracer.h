@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/**
+ * @brief Sampled per-request stage tracing.
+ * A sampled request carries a Span in its HttpConn, every stage stamps a raw
+ * TSC value into it and the finished span goes to the committing thread's
+ * ring (oldest overwritten). Ticks are converted to time only when the rings
+ * are dumped as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ * Unsampled requests pay one branch per stage.
+ */
+class Tracer {
+public:
+    enum STAGE {
+        WAKEUP,          // epoll_wait returned with the request's EPOLLIN
+        ENQUEUE,         // Task handed to the ThreadPool
+        TASK_START,      // Worker picked the task up
+        PARSE_DONE,      // HttpRequest::parse returned
+        RESPONSE_BUILT,  // HttpResponse::MakeResponse returned
+        FIRST_BYTE,      // First successful writev
+        LAST_BYTE,       // Response fully written
+        STAGE_NUM
+    };
+
+    struct Span {
+        uint64_t id;
+        int fd;
+        uint64_t tsc[STAGE_NUM];  // 0 if the stage was not reached
+        char path[48];
+    };
+
+    static Tracer *Instance();
+
+    // sampleRate in [0, 1], 0 disables tracing. Calibrates the TSC.
+    void Init(double sampleRate, size_t ringSize=4096);
+    bool IsOpen() const { return isOpen_; }
+    // Whether to trace the next request, event loop thread only
+    bool Sample() {
+        if (countdown_ == 0) {
+            countdown_ = every_ - 1;
+            return true;
+        }
+        countdown_--;
+        return false;
+    }
+    uint64_t NextId() { return ++lastId_; }
+
+    void Commit(const Span &span);
+    // All spans in the rings as Chrome trace JSON
+    std::string Dump();
+    // The same JSON in pieces of about `want` bytes, for a streamed
+    // response. The rings are copied on the first call; returns false
+    // with the last piece.
+    std::function<bool(std::string &out, size_t want)> DumpStream();
+
+    static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+private:
+    Tracer() = default;
+    ~Tracer() = default;
+
+    struct Ring {
+        std::mutex mtx;  // Only contended while Dump() copies the ring
+        std::vector<Span> spans;
+        size_t next{0};
+        size_t size{0};
+    };
+
+    Ring &LocalRing_() {
+        thread_local Ring *ring = nullptr;
+        if (!ring) {
+            ring = NewRing_();
+        }
+        return *ring;
+    }
+    Ring *NewRing_();
+    std::vector<Span> Snapshot_();
+    double Us_(uint64_t tsc) const {
+        return (static_cast<double>(tsc) - baseTsc_) * nsPerTick_ / 1000;
+    }
+    void AppendSpan_(std::string &out, const Span &span, bool first) const;
+
+    bool isOpen_{false};
+    uint64_t every_{1};
+    uint64_t countdown_{0};
+    uint64_t lastId_{0};
+    size_t ringSize_{0};
+    uint64_t baseTsc_{0};
+    double nsPerTick_{1};
+
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+// Trace state of one connection, stamps are no-ops unless Begin() was called
+class TraceSpan {
+public:
+    bool Active() const { return active_; }
+
+    void Begin(int fd, uint64_t wakeup) {
+        active_ = true;
+        memset(&span_, 0, sizeof(span_));
+        span_.id = Tracer::Instance()->NextId();
+        span_.fd = fd;
+        span_.tsc[Tracer::WAKEUP] = wakeup;
+    }
+    // Keeps the first stamp of a stage, a request may need several reads
+    void Stamp(Tracer::STAGE stage) {
+        if (active_ && span_.tsc[stage] == 0) {
+            span_.tsc[stage] = Tracer::Now();
+        }
+    }
+    void SetPath(const std::string &path) {
+        if (active_) {
+            strncpy(span_.path, path.c_str(), sizeof(span_.path) - 1);
+        }
+    }
+    // Commit what was stamped so far, also for closed or timed out requests
+    void End() {
+        if (active_) {
+            active_ = false;
+            Tracer::Instance()->Commit(span_);
+        }
+    }
+
+private:
+    bool active_{false};
+    Tracer::Span span_;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Sharded LRU cache of username -> password as stored in MySQL.
+ * HttpRequest::UserVerify consults it before taking a SqlConnect, so hot
+ * accounts do not hit MySQL on every login. Entries expire after ttlMS and
+ * are written through on register. A login is checked against the whole
+ * stored value, as the MySQL path does, in constant time.
+ */
+class UserCache {
+public:
+    enum LOOKUP {
+        MISS,      // Not cached (or expired), ask MySQL
+        MATCH,     // Cached and password matches
+        MISMATCH   // Cached and password does not match
+    };
+
+    static UserCache *Instance();
+
+    // capacity == 0 disables the cache
+    void Init(size_t capacity, int ttlMS, size_t shardNum=16);
+    void Set(size_t capacity, int ttlMS);
+    void Clear();
+
+    LOOKUP Verify(const std::string &name, const std::string &pwd);
+    // Whether name is known to exist (register fast-reject)
+    bool Exists(const std::string &name);
+    void Put(const std::string &name, const std::string &pwd);
+    void Invalidate(const std::string &name);
+
+    bool IsOpen() const { return isOpen_; }
+    uint64_t Hits() const;
+    uint64_t Misses() const;
+    size_t Size() const;
+
+private:
+    UserCache() = default;
+    ~UserCache() = default;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        std::string name;
+        std::string password;
+        Clock::time_point expires;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mtx;
+        std::list<Entry> lru;  // Front is the most recently used
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        uint64_t hits{0};
+        uint64_t misses{0};
+    };
+
+    Shard &ShardOf_(const std::string &name);
+    // Find a live entry and move it to the front, caller holds shard lock
+    Entry *Find_(Shard &shard, const std::string &name);
+    static bool Equal_(const std::string &stored, const std::string &pwd);
+    void Clear_();
+
+    // Set() may change these while workers use the cache
+    std::atomic<bool> isOpen_{false};
+    std::atomic<size_t> shardCapacity_{0};
+    std::atomic<int> ttlMS_{0};
+    size_t shardNum_{0};
+    std::unique_ptr<Shard[]> shards_;
+};
@@ -1,65 +1,153 @@
 #pragma once
 
+#include <set>
 #include <unordered_map>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 
+#include "affinity.h"
+#include "config.h"
 #include "httpconn.h"
-#include "heaptimer.h"
+#include "quadheaptimer.h"
 #include "Epoll.h"
 #include "ThreadPool.hpp"
 #include "sqlconnpool.h"
+#include "usercache.h"
+#include "registerbatcher.h"
+#include "metrics.h"
+#include "tracer.h"
+#include "staticbundle.h"
+#include "admission.h"
+#include "ratelimiter.h"
 
 class WebServer {
 public:
-    WebServer(int port,
-              int trigger_mode,
-              int timeoutMS,
-              bool OptLinger,
-              int sqlPort,
-              const char* sqlUser,
-              const char* sqlPwd,
-              const char* dbName,
-              int connPoolNum,
-              int threadNum,
-              bool openLog,
-              int logLevel,
-              int logQueSize);
+    explicit WebServer(const Config &config);
     ~WebServer();
     void Run();
     void Stop();
+    // Async-signal-safe, the event loop handles the signal on its next turn
+    static void Notify(int signo);
 
 private:
     bool InitSocket_();
+    bool Listen_();
+    // Listener options inherited by or affecting accepted sockets
+    void InitTcpOptions_();
     void InitEventMode_(int trigMode);
     void AddClient_(int fd, sockaddr_in addr);
 
     void DealListen_();
     void DealWrite_(HttpConn *client);
     void DealRead_(HttpConn *client);
+    // Armed ET mode: hand the events to the owner, or become it
+    void DealEvents_(HttpConn *client, uint32_t events);
+    // Only a request not yet started may be shed
+    static bool IsNewRequest_(HttpConn *client);
+    // Answer with the prebuilt 503 and close
+    void Shed_(HttpConn *client);
+    // Queueing delay bookkeeping as a worker picks up a task
+    static void TaskStart_(int64_t queued);
+    // Run a blocking handler on the blocking pool, which then resumes the
+    // connection on a worker. false if the pool is full and a 503 is due.
+    bool Offload_(HttpConn *client);
+    // Continue where Handle() stopped, with the response to build
+    void Resume_(HttpConn *client);
 
-    void ExtentTime_(HttpConn *client);
+    // Refresh the deadline of client's current phase, O(1)
+    void ExtentTime_(HttpConn *client, HttpConn::TIMEOUT phase);
+    // Close expired connections, return ms until the next timer
+    int HandleTimeouts_();
+    // When to look again at a connection a worker owns
+    int RecheckMS_() const;
+    // Armed ET: let go of a connection the loop took with TryOwn(), events
+    // that came in meanwhile go to a worker
+    void Disown_(HttpConn *client);
     void CloseConn_(HttpConn *client);
+    // Timer callback, expires idle rate limit buckets and re-schedules
+    static void SweepRateLimit_(void *server);
 
     void OnRead_(HttpConn *client);
     void OnWrite_(HttpConn *client);
     void OnProcess_(HttpConn *client);
+    void OnEvents_(HttpConn *client);
+    // Read, handle and write until the socket blocks, false once closed or
+    // handed to the blocking pool
+    bool Drive_(HttpConn *client);
+    // Built-in endpoints and page aliases
+    static void InitRoutes_(const std::string &metricsPath,
+                            const std::string &tracePath);
+    // Stats owned by other modules, appended to the metrics page
+    static void CollectMetrics_(std::string &out);
+    void DealSignals_();
+    // Stop accepting, close idle connections, let the rest finish
+    void StartDrain_();
+    // Close idle connections, end Run() once all are gone or time is up
+    void Drain_();
+    void StartUpgrade_();
+    // The new process is ready, or it failed
+    void DealUpgrade_();
+    static bool SendFd_(int sock, int fd);
+    static int RecvFd_(int sock);
+    // Rebuild the static bundle off the event loop and swap it in
+    void ReloadStatic_();
+    static void BuildStatic_(const std::string &srcDir, size_t maxFileSize);
+    // Watch the config file's directory, editors replace the file
+    void InitConfigWatch_();
+    void DealConfigWatch_();
+    // Apply what may change at runtime, report the rest
+    void ReloadConfig_();
 
-    static const int MAX_FD = 1 << 16;
+    static constexpr int MAX_FD = 1 << 16;
+    static constexpr int DRAIN_TICK_MS = 100;
+    static const char UPGRADE_ENV[];  // Names the fd to the old process
 
-    static int SetFdNonblock_(int fd);
+    static int64_t NowMS_();
+    // Names the worker and pins it to one of cores, round robin
+    static void StartWorker_(const std::vector<int> &cores, size_t index);
+    // Warn about pinning that splits the reactor and workers across nodes
+    static void CheckNuma_(const Config::Cpu &cpu);
 
+    Config config_;        // As loaded, restart-only keys as started
     int port_;
     bool openLinger_;
-    int timeoutMS_;
+    // Read by workers, changed on reload
+    std::atomic<int> timeoutMS_;  // Keep-alive idle timeout, <= 0: no timers
+    std::atomic<int> headerTimeoutMS_;  // Whole request must arrive within
+    std::atomic<int> writeTimeoutMS_;   // Max time without write progress
     bool isClosed_;
     int listenFd_;
     char* srcDir_;
 
+    uint64_t wakeupTsc_;   // When epoll_wait last returned, if tracing
+    bool staticBundle_;
+    size_t staticMaxFileSize_;
+    bool armedET_;         // Conn fds registered once, never re-armed
+    bool tcpNoDelay_;
+    int deferAcceptS_;     // Wake on data, not on the handshake, 0 disables
+    int fastOpenQueue_;    // Pending TFO requests, 0 disables
+    int acceptBatch_;      // Max accepts per listen event
+    int drainTimeoutMS_;
+    bool isDraining_{false};
+    int64_t drainDeadline_{0};
+    int upgradeFd_{-1};    // Unix socket to the other process of an upgrade
+    pid_t upgradePid_{-1};
+    int configWatchFd_{-1};  // inotify on the config directory
+
+    static int signalFd_;  // eventfd written by Notify()
+    static std::atomic<uint32_t> pendingSignals_;
+
     uint32_t listenEvent_;
     uint32_t connEvent_;
 
-    std::unique_ptr<HeapTimer> timer_;
+    std::unique_ptr<QuadHeapTimer> timer_;
+    std::vector<TimerHook*> expired_;
+    TimerHook sweepHook_;  // Connection hooks have no callback, this one has
     std::unique_ptr<ThreadPool> threadpool_;
+    std::unique_ptr<ThreadPool> blockingPool_;  // Null: blocking runs inline
     std::unique_ptr<Epoll> epoll_;
     std::unordered_map<int, HttpConn> users_;
 };
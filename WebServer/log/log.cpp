@@ -2,6 +2,7 @@
 #include <stdarg.h>
 
 #include "log.h"
+#include "affinity.h"
 using namespace std;
 
 Log::~Log() {
@@ -63,10 +64,10 @@ void Log::Init(int level=1, const char *path,
             flush();
             fclose(fp_);
         }
-        fp_ = fopen(fileName, "a");
+        fp_ = fopen(fileName, "ae");
         if (fp_ == nullptr) {
             mkdir(path_, 0777);
-            if ((fp_ = fopen(fileName, "a")) == nullptr) {
+            if ((fp_ = fopen(fileName, "ae")) == nullptr) {
                 perror("fopen");
                 exit(EXIT_FAILURE);
             }
@@ -105,7 +106,7 @@ void Log::write(int level, const char *format, ...) {
         locker.lock();
         flush();
         fclose(fp_);
-        if ((fp_ = fopen(newFile, "a")) == nullptr) {
+        if ((fp_ = fopen(newFile, "ae")) == nullptr) {
             perror("fopen");
             exit(EXIT_FAILURE);
         }
@@ -180,5 +181,10 @@ Log* Log::Instance() {
 }
 
 void Log::FlushLogThread() {
+    Affinity::SetName("ws-log");
     Log::Instance()->AsyncWrite_();
 }
+
+bool Log::PinWriter(const vector<int> &cores) {
+    return writeThread_ && Affinity::Pin(writeThread_->native_handle(), cores);
+}
@@ -0,0 +1,189 @@
+#include <cstdio>
+
+#include "metrics.h"
+
+using namespace std;
+
+constexpr int Metrics::STATUS_CODES[];
+
+namespace {
+
+const char *COUNTER_NAME[][2] = {
+    {"webserver_accepted_total", "Connections accepted."},
+    {"webserver_received_bytes_total", "Bytes read from clients."},
+    {"webserver_sent_bytes_total", "Bytes written to clients."},
+    {"webserver_timeouts_total", "Connections closed by a timeout."},
+    {"webserver_direct_writes_total",
+     "Responses written completely by the worker that built them."},
+    {"webserver_deferred_writes_total",
+     "Responses that had to wait for the socket to become writable."},
+    {"webserver_rejected_connections_total",
+     "Connections refused at accept by a connection cap."},
+    {"webserver_shed_requests_total",
+     "Requests answered with 503 while the server was overloaded."},
+    {"webserver_offloaded_requests_total",
+     "Requests whose handler ran on the blocking pool."},
+};
+
+const char *GAUGE_NAME[][2] = {
+    {"webserver_idle_connections",
+     "Keep-alive connections waiting for a request."},
+    {"webserver_blocking_queued",
+     "Tasks waiting for a blocking pool thread."},
+};
+
+const char *HISTOGRAM_NAME[][2] = {
+    {"webserver_queue_wait_seconds", "Time a task waits in the ThreadPool."},
+    {"webserver_parse_seconds", "Time spent parsing a request."},
+    {"webserver_build_seconds", "Time spent building a response."},
+    {"webserver_write_seconds", "Time from response built to last byte."},
+    {"webserver_db_wait_seconds", "Time waiting for a MySQL connection."},
+    {"webserver_blocking_wait_seconds",
+     "Time a task waits in the blocking pool."},
+    {"webserver_blocking_run_seconds", "Time a blocking handler runs."},
+};
+
+void Header(string &out, const char *name, const char *help,
+            const char *type) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+string Seconds(double us) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", us / 1e6);
+    return buf;
+}
+
+}  // namespace
+
+Metrics *Metrics::Instance() {
+    static Metrics metrics;
+    return &metrics;
+}
+
+Metrics::Shard *Metrics::NewShard_() {
+    // Value-initialized, so every counter starts at zero
+    unique_ptr<Shard> shard(new Shard());
+    lock_guard<mutex> locker(mtx_);
+    shards_.push_back(move(shard));
+    return shards_.back().get();
+}
+
+void Metrics::Observe(HISTOGRAM histogram, int64_t us) {
+    if (us < 0) {
+        us = 0;
+    }
+    int bucket = 0;
+    if (us > 1) {
+        // Smallest i with us <= 2^i, bucket i is exported as le=2^i
+        bucket = 64 - __builtin_clzll(static_cast<uint64_t>(us - 1));
+    }
+    if (bucket >= BUCKET_NUM) {
+        bucket = BUCKET_NUM - 1;
+    }
+    Histogram &h = LocalShard_().histograms[histogram];
+    Bump_(h.buckets[bucket], 1);
+    Bump_(h.count, 1);
+    Bump_(h.sumUs, static_cast<uint64_t>(us));
+}
+
+void Metrics::AddCollector(function<void(string&)> collector) {
+    lock_guard<mutex> locker(mtx_);
+    collectors_.push_back(move(collector));
+}
+
+uint64_t Metrics::Get(COUNTER counter) {
+    lock_guard<mutex> locker(mtx_);
+    uint64_t sum = 0;
+    for (auto &shard : shards_) {
+        sum += shard->counters[counter].load(memory_order_relaxed);
+    }
+    return sum;
+}
+
+int64_t Metrics::Get(GAUGE gauge) {
+    lock_guard<mutex> locker(mtx_);
+    uint64_t sum = 0;
+    for (auto &shard : shards_) {
+        sum += shard->gauges[gauge].load(memory_order_relaxed);
+    }
+    // Deltas wrap around, the total is the signed value
+    return static_cast<int64_t>(sum);
+}
+
+string Metrics::Render() {
+    uint64_t counters[COUNTER_NUM] = {0};
+    uint64_t gauges[GAUGE_NUM] = {0};
+    uint64_t status[STATUS_NUM] = {0};
+    uint64_t buckets[HISTOGRAM_NUM][BUCKET_NUM] = {{0}};
+    uint64_t count[HISTOGRAM_NUM] = {0};
+    uint64_t sumUs[HISTOGRAM_NUM] = {0};
+    vector<function<void(string&)>> collectors;
+    {
+        lock_guard<mutex> locker(mtx_);
+        for (auto &shard : shards_) {
+            for (int i = 0; i < COUNTER_NUM; i++) {
+                counters[i] += shard->counters[i].load(memory_order_relaxed);
+            }
+            for (int i = 0; i < GAUGE_NUM; i++) {
+                gauges[i] += shard->gauges[i].load(memory_order_relaxed);
+            }
+            for (int i = 0; i < STATUS_NUM; i++) {
+                status[i] += shard->status[i].load(memory_order_relaxed);
+            }
+            for (int i = 0; i < HISTOGRAM_NUM; i++) {
+                Histogram &h = shard->histograms[i];
+                for (int b = 0; b < BUCKET_NUM; b++) {
+                    buckets[i][b] += h.buckets[b].load(memory_order_relaxed);
+                }
+                count[i] += h.count.load(memory_order_relaxed);
+                sumUs[i] += h.sumUs.load(memory_order_relaxed);
+            }
+        }
+        collectors = collectors_;
+    }
+
+    string out;
+    out.reserve(8192);
+    Header(out, "webserver_requests_total", "Responses by status code.",
+           "counter");
+    for (int i = 0; i < STATUS_NUM; i++) {
+        out += "webserver_requests_total{code=\"";
+        out += i < STATUS_NUM - 1 ? to_string(STATUS_CODES[i]) : "other";
+        out += "\"} " + to_string(status[i]) + "\n";
+    }
+    for (int i = 0; i < COUNTER_NUM; i++) {
+        Header(out, COUNTER_NAME[i][0], COUNTER_NAME[i][1], "counter");
+        out += string(COUNTER_NAME[i][0]) + " " + to_string(counters[i]) + "\n";
+    }
+    for (int i = 0; i < GAUGE_NUM; i++) {
+        Header(out, GAUGE_NAME[i][0], GAUGE_NAME[i][1], "gauge");
+        out += string(GAUGE_NAME[i][0]) + " " +
+               to_string(static_cast<int64_t>(gauges[i])) + "\n";
+    }
+    for (int i = 0; i < HISTOGRAM_NUM; i++) {
+        const string name = HISTOGRAM_NAME[i][0];
+        Header(out, HISTOGRAM_NAME[i][0], HISTOGRAM_NAME[i][1], "histogram");
+        uint64_t cumulative = 0;
+        for (int b = 0; b < BUCKET_NUM - 1; b++) {
+            cumulative += buckets[i][b];
+            out += name + "_bucket{le=\"" + Seconds(1ull << b) + "\"} " +
+                   to_string(cumulative) + "\n";
+        }
+        out += name + "_bucket{le=\"+Inf\"} " + to_string(count[i]) + "\n";
+        out += name + "_sum " + Seconds(static_cast<double>(sumUs[i])) + "\n";
+        out += name + "_count " + to_string(count[i]) + "\n";
+    }
+    for (auto &collector : collectors) {
+        collector(out);
+    }
+    return out;
+}
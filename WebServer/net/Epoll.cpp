@@ -2,7 +2,7 @@
 
 #include "Epoll.h"
 
-Epoll::Epoll(int maxEvent) : epoll_fd_(epoll_create1(0)),
+Epoll::Epoll(int maxEvent) : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
     events_(maxEvent) {
     assert(epoll_fd_ >= 0 && events_.size() == maxEvent);
 }
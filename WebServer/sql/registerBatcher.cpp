@@ -0,0 +1,194 @@
+#include <cassert>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "registerbatcher.h"
+#include "affinity.h"
+#include "log.h"
+using namespace std;
+
+RegisterBatcher* RegisterBatcher::Instance() {
+    static RegisterBatcher batcher;
+    return &batcher;
+}
+
+/**
+ * @brief Start the registration write-behind thread
+ *
+ * @param connPool Pool the batch connection is taken from
+ * @param windowMS Max time the first pending register waits for company
+ * @param maxBatch Flush as soon as this many registers are pending
+ */
+void RegisterBatcher::Init(SqlConnPool *connPool, int windowMS, int maxBatch) {
+    assert(connPool);
+    connPool_ = connPool;
+    windowMS_ = windowMS;
+    maxBatch_ = max(1, maxBatch);
+    isOpen_ = windowMS > 0 && maxBatch > 1;
+    if (isOpen_ && !worker_.joinable()) {
+        isClose_ = false;
+        worker_ = thread(&RegisterBatcher::Run_, this);
+    }
+}
+
+void RegisterBatcher::Close() {
+    {
+        scoped_lock<mutex> locker(mtx_);
+        isClose_ = true;
+    }
+    cond_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+    isOpen_ = false;
+}
+
+RegisterBatcher::~RegisterBatcher() {
+    Close();
+}
+
+future<RegisterBatcher::RESULT> RegisterBatcher::Submit(const string &name,
+                                                        const string &pwd) {
+    Pending item{name, pwd, promise<RESULT>()};
+    future<RESULT> result = item.result.get_future();
+    bool wake = false;
+    {
+        scoped_lock<mutex> locker(mtx_);
+        if (isClose_) {
+            item.result.set_value(FAILED);
+            return result;
+        }
+        pending_.push_back(move(item));
+        wake = pending_.size() == 1 || pending_.size() >= maxBatch_;
+    }
+    if (wake) {
+        cond_.notify_one();
+    }
+    return result;
+}
+
+void RegisterBatcher::Run_() {
+    Affinity::SetName("ws-register");
+    unique_lock<mutex> locker(mtx_);
+    while (true) {
+        cond_.wait(locker, [this] { return isClose_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            break;  // Closed and drained
+        }
+        // Group commit window starts with the first pending register
+        cond_.wait_for(locker, chrono::milliseconds(windowMS_), [this] {
+            return isClose_ || pending_.size() >= maxBatch_;
+        });
+        vector<Pending> batch;
+        batch.swap(pending_);
+        locker.unlock();
+        Flush_(batch);
+        locker.lock();
+    }
+}
+
+string RegisterBatcher::Escape_(MYSQL *sql, const string &str) {
+    string escaped(str.size() * 2 + 1, '\0');
+    escaped.resize(mysql_real_escape_string(sql, &escaped[0], str.c_str(),
+                                            str.size()));
+    return escaped;
+}
+
+RegisterBatcher::RESULT RegisterBatcher::InsertOne(MYSQL *sql,
+                                                   const string &name,
+                                                   const string &pwd) {
+    assert(sql);
+    string escName = Escape_(sql, name);
+    string query = "SELECT username FROM user WHERE username='" + escName +
+                   "' LIMIT 1";
+    if (mysql_real_query(sql, query.data(), query.size())) {
+        return FAILED;
+    }
+    MYSQL_RES *res = mysql_store_result(sql);
+    bool exists = res && mysql_num_rows(res);
+    mysql_free_result(res);
+    if (exists) { // User already exists
+        return DUPLICATE;
+    }
+    query = "INSERT INTO user(username, password) VALUES('" + escName + "','" +
+            Escape_(sql, pwd) + "')";
+    if (mysql_real_query(sql, query.data(), query.size())) {
+        LOG_DEBUG("Insert error: %s", mysql_error(sql));
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+void RegisterBatcher::Flush_(vector<Pending> &batch) {
+    vector<RESULT> results(batch.size(), FAILED);
+    MYSQL *sql;
+    {
+        SqlConnect conn(&sql, connPool_);
+        if (sql) {
+            // A name may only be taken once inside the batch
+            unordered_map<string, size_t> first;
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (!first.emplace(batch[i].name, i).second) {
+                    results[i] = DUPLICATE;
+                }
+            }
+
+            string query = "SELECT username FROM user WHERE username IN (";
+            for (auto &item : first) {
+                query += "'" + Escape_(sql, item.first) + "',";
+            }
+            query.back() = ')';
+            unordered_set<string> exists;
+            bool ok = !mysql_real_query(sql, query.data(), query.size());
+            if (ok) {
+                MYSQL_RES *res = mysql_store_result(sql);
+                while (MYSQL_ROW row = res ? mysql_fetch_row(res) : nullptr) {
+                    exists.insert(row[0]);
+                }
+                mysql_free_result(res);
+            }
+
+            vector<size_t> inserts;
+            query = "INSERT INTO user(username, password) VALUES";
+            for (auto &item : first) {
+                if (exists.count(item.first)) {
+                    results[item.second] = DUPLICATE;
+                    continue;
+                }
+                inserts.push_back(item.second);
+                query += "('" + Escape_(sql, item.first) + "','" +
+                         Escape_(sql, batch[item.second].pwd) + "'),";
+            }
+            query.pop_back();
+
+            if (ok && inserts.size()) {
+                // One transaction, one commit for the whole batch
+                mysql_autocommit(sql, 0);
+                ok = !mysql_real_query(sql, query.data(), query.size()) &&
+                     !mysql_commit(sql);
+                if (!ok) {
+                    LOG_WARN("Batch insert of %lu users failed: %s",
+                             inserts.size(), mysql_error(sql));
+                    mysql_rollback(sql);
+                }
+                mysql_autocommit(sql, 1);
+                if (ok) {
+                    for (size_t i : inserts) {
+                        results[i] = SUCCESS;
+                    }
+                } else {
+                    // Lost a race with another writer, resolve one by one
+                    for (size_t i : inserts) {
+                        results[i] = InsertOne(sql, batch[i].name,
+                                               batch[i].pwd);
+                    }
+                }
+            }
+            LOG_DEBUG("Register batch:%lu, insert:%lu", batch.size(),
+                      inserts.size());
+        }
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].result.set_value(results[i]);
+    }
+}
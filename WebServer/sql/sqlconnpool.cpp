@@ -1,7 +1,10 @@
 #include <cassert>
+#include <vector>
 
 #include "sqlconnpool.h"
+#include "affinity.h"
 #include "log.h"
+#include "metrics.h"
 using namespace std;
 
 SqlConnPool* SqlConnPool::Instance() {
@@ -17,61 +20,279 @@ SqlConnPool* SqlConnPool::Instance() {
  * @param user
  * @param pwd
  * @param dbName
- * @param connSize Connection pool size, default=10
+ * @param minConn Connections kept open even when idle, default=10
+ * @param maxConn Upper bound the pool grows to under load, <= 0 means minConn
+ * @param waitTimeoutMS Default max time GetConn() waits for a connection
+ * @param idleTimeoutMS Connections above minConn idle longer are closed
  */
 void SqlConnPool::Init(const char *host, int port, const char *user,
-                        const char *pwd, const char *dbName, int connSize=10) {
-    assert(connSize > 0);
-    // Create coonSize connections
-    for (int i = 0; i < connSize; i++) {
-        MYSQL *sql = nullptr;
-        sql = mysql_init(sql);
+                        const char *pwd, const char *dbName, int minConn,
+                        int maxConn, int waitTimeoutMS, int idleTimeoutMS) {
+    assert(minConn > 0);
+    host_ = host;
+    port_ = port;
+    user_ = user;
+    pwd_ = pwd;
+    dbName_ = dbName;
+    MIN_CONN_ = minConn;
+    MAX_CONN_ = max(minConn, maxConn);
+    waitTimeoutMS_ = max(0, waitTimeoutMS);
+    idleTimeoutMS_ = idleTimeoutMS;
+
+    // Create minConn connections, failed ones are retried in background
+    for (int i = 0; i < MIN_CONN_; i++) {
+        MYSQL *sql = Connect_();
         if (!sql) {
-            LOG_ERROR("MySql init error!");
-            assert(sql);
-        }
-        if (!mysql_real_connect(sql, host, user, pwd,
-                        dbName, port, nullptr, 0)) {
-            LOG_ERROR("MySql Connect error!");
-            LOG_ERROR("Failed to connect to database: %s", mysql_error(sql));
             continue;
         }
         LOG_INFO("MySql conn: %d Connected!", i);
-        connQue_.push(sql);
+        Clock::time_point now = Clock::now();
+        scoped_lock<mutex> locker(mtx_);
+        connQue_.push_back({sql, now, now});
+        total_++;
     }
-    MAX_CONN_ = connSize;
-    sem_init(&semId_, 0, MAX_CONN_);
+    {
+        scoped_lock<mutex> locker(mtx_);
+        isClose_ = false;
+    }
+    maintainer_ = thread(&SqlConnPool::Maintain_, this);
 }
 
-MYSQL* SqlConnPool::GetConn() { // Consumer
-    MYSQL *sql = nullptr;
-    if (connQue_.empty()) {
-        LOG_WARN("SqlConnPool is busy");
-        return nullptr;
-    }
-    sem_wait(&semId_);
+void SqlConnPool::Resize(int minConn, int maxConn, int waitTimeoutMS,
+                         int idleTimeoutMS) {
+    assert(minConn > 0);
     {
         scoped_lock<mutex> locker(mtx_);
-        sql = connQue_.front();
-        connQue_.pop();
+        MIN_CONN_ = minConn;
+        MAX_CONN_ = max(minConn, maxConn);
+        waitTimeoutMS_ = max(0, waitTimeoutMS);
+        idleTimeoutMS_ = idleTimeoutMS;
+    }
+    // Connect up to the new minimum now, waiters may grow past the old max
+    condMaintain_.notify_one();
+    condConn_.notify_all();
+}
+
+MYSQL* SqlConnPool::Connect_() {
+    MYSQL *sql = mysql_init(nullptr);
+    if (!sql) {
+        LOG_ERROR("MySql init error!");
+        return nullptr;
+    }
+    // Without read/write timeouts a half-dead peer blocks until TCP gives up
+    unsigned int connectTimeout = CONNECT_TIMEOUT_S;
+    unsigned int ioTimeout = IO_TIMEOUT_S;
+    mysql_options(sql, MYSQL_OPT_CONNECT_TIMEOUT, &connectTimeout);
+    mysql_options(sql, MYSQL_OPT_READ_TIMEOUT, &ioTimeout);
+    mysql_options(sql, MYSQL_OPT_WRITE_TIMEOUT, &ioTimeout);
+    if (!mysql_real_connect(sql, host_.c_str(), user_.c_str(), pwd_.c_str(),
+                            dbName_.c_str(), port_, nullptr, 0)) {
+        LOG_ERROR("MySql Connect error!");
+        LOG_ERROR("Failed to connect to database: %s", mysql_error(sql));
+        mysql_close(sql);
+        return nullptr;
     }
     return sql;
 }
 
+MYSQL* SqlConnPool::GetConn(int timeoutMS) { // Consumer
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + chrono::milliseconds(
+        timeoutMS < 0 ? waitTimeoutMS_.load() : timeoutMS);
+    MYSQL *sql = nullptr;
+    bool isGrowing = false;
+
+    // Connecting and pinging may take seconds, the maintainer does both and
+    // this only waits, so the caller never waits past its deadline
+    unique_lock<mutex> locker(mtx_);
+    while (!isClose_ && !sql) {
+        if (!connQue_.empty()) {
+            IdleConn conn = connQue_.back();
+            connQue_.pop_back();
+            if (Clock::now() - conn.checked <
+                    chrono::milliseconds(VALIDATE_IDLE_MS)) {
+                sql = conn.sql;
+                break;
+            }
+            // Idle for a while, have it pinged before anyone uses it
+            stale_.push_back(conn);
+            condMaintain_.notify_one();
+            continue;
+        }
+        if (!isGrowing && total_ < MAX_CONN_) {
+            // Grow under load, once per caller
+            isGrowing = true;
+            total_++;
+            growing_++;
+            condMaintain_.notify_one();
+        }
+        if (condConn_.wait_until(locker, deadline) == cv_status::timeout
+                && connQue_.empty()) {
+            timeouts_++;
+            LOG_WARN("SqlConnPool is busy");
+            return nullptr;
+        }
+    }
+    if (!sql) {
+        return nullptr;
+    }
+
+    uint64_t waitUs = chrono::duration_cast<chrono::microseconds>(
+        Clock::now() - start).count();
+    Metrics::Instance()->Observe(Metrics::DB_WAIT, waitUs);
+    acquired_++;
+    waitUs_ += waitUs;
+    maxWaitUs_ = max(maxWaitUs_, waitUs);
+    return sql;
+}
+
 void SqlConnPool::FreeConn(MYSQL* sql) { // Producer
     assert(sql);
-    scoped_lock<mutex> locker(mtx_);
-    connQue_.push(sql);
-    sem_post(&semId_);
+    {
+        scoped_lock<mutex> locker(mtx_);
+        if (!isClose_ && total_ <= MAX_CONN_) {
+            Clock::time_point now = Clock::now();
+            connQue_.push_back({sql, now, now});
+            sql = nullptr;
+        } else {
+            total_--;
+        }
+    }
+    if (sql) {
+        // Pool already closed, or shrunk below what is open
+        mysql_close(sql);
+        return;
+    }
+    condConn_.notify_one();
 }
 
-void SqlConnPool::ClosePool() {
-    scoped_lock<mutex> locker(mtx_);
-    // Close all SQL connection
+void SqlConnPool::Maintain_() {
+    Affinity::SetName("ws-sql-pool");
+    unique_lock<mutex> locker(mtx_);
+    while (!isClose_) {
+        condMaintain_.wait_for(locker,
+                               chrono::milliseconds(MAINTAIN_INTERVAL_MS),
+                               [this] {
+            return isClose_ || growing_ > 0 || !stale_.empty();
+        });
+        if (isClose_) {
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        vector<MYSQL*> idle;
+        vector<IdleConn> check(stale_.begin(), stale_.end());
+        stale_.clear();
+
+        // Shrink: the front of the queue has been idle the longest
+        while (!connQue_.empty() && total_ > MIN_CONN_ && idleTimeoutMS_ > 0
+               && now - connQue_.front().since >
+                      chrono::milliseconds(idleTimeoutMS_)) {
+            idle.push_back(connQue_.front().sql);
+            connQue_.pop_front();
+            total_--;
+        }
+        // Take out connections that have not been checked for a while
+        for (auto it = connQue_.begin(); it != connQue_.end();) {
+            if (now - it->checked > chrono::milliseconds(KEEPALIVE_MS)) {
+                check.push_back(*it);
+                it = connQue_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // Up to minConn, plus what waiting GetConn() calls asked for
+        int refill = max(0, MIN_CONN_ - total_);
+        int missing = refill + growing_;
+        total_ += refill;
+        growing_ = 0;
+        locker.unlock();
+
+        for (MYSQL *sql : idle) {
+            mysql_close(sql);
+        }
+        if (idle.size()) {
+            LOG_INFO("SqlConnPool shrink %lu idle connections", idle.size());
+        }
+        int broken = 0;
+        for (IdleConn &conn : check) {
+            if (mysql_ping(conn.sql) == 0) {
+                conn.checked = Clock::now();
+            } else {
+                LOG_WARN("MySql conn broken: %s", mysql_error(conn.sql));
+                mysql_close(conn.sql);
+                conn.sql = nullptr;
+                broken++;
+            }
+        }
+        locker.lock();
+        for (IdleConn &conn : check) {
+            if (conn.sql) {
+                connQue_.push_front(conn);
+            }
+        }
+        total_ -= broken;
+        if (check.size() > static_cast<size_t>(broken)) {
+            condConn_.notify_all();
+        }
+        locker.unlock();
+
+        // Reconnect, a broken one is replaced next round. Each is handed
+        // out as it comes, a waiter does not wait for the rest
+        for (int i = 0; i < missing; i++) {
+            MYSQL *sql = Connect_();
+            locker.lock();
+            if (sql) {
+                now = Clock::now();
+                connQue_.push_back({sql, now, now});
+                reconnects_ += i < refill;
+            } else {
+                total_--;
+            }
+            if (isClose_) {
+                // Do not hold up ClosePool() with the rest
+                total_ -= missing - i - 1;
+                break;
+            }
+            locker.unlock();
+            if (sql) {
+                condConn_.notify_one();
+            }
+        }
+        if (!locker.owns_lock()) {
+            locker.lock();
+        }
+    }
+    // Close what was handed back while the pool was being closed
+    for (IdleConn &conn : stale_) {
+        mysql_close(conn.sql);
+        total_--;
+    }
+    stale_.clear();
     while (connQue_.size()) {
-        MYSQL *sql = connQue_.front();
-        connQue_.pop();
-        mysql_close(sql);
+        mysql_close(connQue_.front().sql);
+        connQue_.pop_front();
+        total_--;
+    }
+}
+
+void SqlConnPool::ClosePool() {
+    {
+        scoped_lock<mutex> locker(mtx_);
+        if (isClose_ && !maintainer_.joinable()) {
+            return;
+        }
+        isClose_ = true;
+        // Close all SQL connection
+        while (connQue_.size()) {
+            mysql_close(connQue_.front().sql);
+            connQue_.pop_front();
+            total_--;
+        }
+    }
+    condMaintain_.notify_all();
+    condConn_.notify_all();
+    if (maintainer_.joinable()) {
+        maintainer_.join();
     }
     mysql_library_end();
 }
@@ -81,6 +302,17 @@ int SqlConnPool::GetFreeConnCount() const {
     return connQue_.size();
 }
 
+int SqlConnPool::GetConnCount() const {
+    scoped_lock<mutex> locker(mtx_);
+    return total_;
+}
+
+SqlConnPool::Stats SqlConnPool::GetStats() const {
+    scoped_lock<mutex> locker(mtx_);
+    return {acquired_, timeouts_, waitUs_, maxWaitUs_, reconnects_, total_,
+            static_cast<int>(connQue_.size())};
+}
+
 SqlConnPool::~SqlConnPool() {
     ClosePool();
 }
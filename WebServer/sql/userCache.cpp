@@ -0,0 +1,169 @@
+#include <cassert>
+#include <functional>
+
+#include "usercache.h"
+using namespace std;
+
+UserCache* UserCache::Instance() {
+    static UserCache cache;
+    return &cache;
+}
+
+/**
+ * @brief Init user cache
+ *
+ * @param capacity Max number of cached users, 0 disables the cache
+ * @param ttlMS Entry lifetime, stale entries are treated as a miss
+ * @param shardNum Number of independently locked LRU lists
+ */
+void UserCache::Init(size_t capacity, int ttlMS, size_t shardNum) {
+    assert(shardNum > 0);
+    shardNum_ = shardNum;
+    shards_.reset(new Shard[shardNum_]);
+    Set(capacity, ttlMS);
+}
+
+/**
+ * @brief Change capacity and ttl of a running cache. A smaller capacity
+ * is reached as entries are added, turning it off drops all entries.
+ */
+void UserCache::Set(size_t capacity, int ttlMS) {
+    shardCapacity_ = max<size_t>(1, capacity / shardNum_);
+    ttlMS_ = ttlMS;
+    bool wasOpen = isOpen_.exchange(capacity > 0 && ttlMS > 0);
+    if (wasOpen && !isOpen_) {
+        Clear_();
+    }
+}
+
+void UserCache::Clear() {
+    if (isOpen_) {
+        Clear_();
+    }
+}
+
+void UserCache::Clear_() {
+    for (size_t i = 0; i < shardNum_; i++) {
+        scoped_lock<mutex> locker(shards_[i].mtx);
+        shards_[i].index.clear();
+        shards_[i].lru.clear();
+    }
+}
+
+UserCache::Shard& UserCache::ShardOf_(const string &name) {
+    return shards_[hash<string>{}(name) % shardNum_];
+}
+
+bool UserCache::Equal_(const string &stored, const string &pwd) {
+    // Touch every byte whatever matches, so timing does not leak a prefix
+    unsigned char diff = stored.size() == pwd.size() ? 0 : 1;
+    for (size_t i = 0; i < pwd.size(); i++) {
+        diff |= static_cast<unsigned char>(
+            pwd[i] ^ (i < stored.size() ? stored[i] : 0));
+    }
+    return diff == 0;
+}
+
+UserCache::Entry* UserCache::Find_(Shard &shard, const string &name) {
+    auto it = shard.index.find(name);
+    if (it == shard.index.end()) {
+        return nullptr;
+    }
+    if (it->second->expires <= Clock::now()) {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return &shard.lru.front();
+}
+
+UserCache::LOOKUP UserCache::Verify(const string &name, const string &pwd) {
+    if (!isOpen_) {
+        return MISS;
+    }
+    Shard &shard = ShardOf_(name);
+    scoped_lock<mutex> locker(shard.mtx);
+    Entry *entry = Find_(shard, name);
+    if (!entry) {
+        shard.misses++;
+        return MISS;
+    }
+    shard.hits++;
+    return Equal_(entry->password, pwd) ? MATCH : MISMATCH;
+}
+
+bool UserCache::Exists(const string &name) {
+    if (!isOpen_) {
+        return false;
+    }
+    Shard &shard = ShardOf_(name);
+    scoped_lock<mutex> locker(shard.mtx);
+    if (Find_(shard, name)) {
+        shard.hits++;
+        return true;
+    }
+    shard.misses++;
+    return false;
+}
+
+void UserCache::Put(const string &name, const string &pwd) {
+    if (!isOpen_) {
+        return;
+    }
+    Shard &shard = ShardOf_(name);
+    scoped_lock<mutex> locker(shard.mtx);
+    auto it = shard.index.find(name);
+    if (it != shard.index.end()) {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    while (shard.lru.size() >= shardCapacity_) {
+        // Evict the least recently used entry
+        shard.index.erase(shard.lru.back().name);
+        shard.lru.pop_back();
+    }
+    shard.lru.push_front({name, pwd,
+                          Clock::now() + chrono::milliseconds(ttlMS_.load())});
+    shard.index[name] = shard.lru.begin();
+}
+
+void UserCache::Invalidate(const string &name) {
+    if (!isOpen_) {
+        return;
+    }
+    Shard &shard = ShardOf_(name);
+    scoped_lock<mutex> locker(shard.mtx);
+    auto it = shard.index.find(name);
+    if (it != shard.index.end()) {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+}
+
+uint64_t UserCache::Hits() const {
+    uint64_t hits = 0;
+    for (size_t i = 0; isOpen_ && i < shardNum_; i++) {
+        scoped_lock<mutex> locker(shards_[i].mtx);
+        hits += shards_[i].hits;
+    }
+    return hits;
+}
+
+uint64_t UserCache::Misses() const {
+    uint64_t misses = 0;
+    for (size_t i = 0; isOpen_ && i < shardNum_; i++) {
+        scoped_lock<mutex> locker(shards_[i].mtx);
+        misses += shards_[i].misses;
+    }
+    return misses;
+}
+
+size_t UserCache::Size() const {
+    size_t size = 0;
+    for (size_t i = 0; isOpen_ && i < shardNum_; i++) {
+        scoped_lock<mutex> locker(shards_[i].mtx);
+        size += shards_[i].lru.size();
+    }
+    return size;
+}
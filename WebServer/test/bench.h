@@ -0,0 +1,92 @@
+/**
+ * @file bench.h
+ * @brief Self-contained microbenchmark harness for the test/ targets.
+ * Every case runs several rounds and prints one JSON line with the median
+ * round, e.g.
+ *   {"suite":"buffer","name":"append/64","iters":100000,"ns_per_op":12.3,...}
+ * so results of two commits can be diffed per hot path. A substring given
+ * as argv[1] only runs the matching cases.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+typedef std::chrono::steady_clock Clock;
+
+inline std::string &Filter() {
+    static std::string filter;
+    return filter;
+}
+
+inline void Init(int argc, char *argv[]) {
+    if (argc > 1) {
+        Filter() = argv[1];
+    }
+}
+
+inline bool Selected(const std::string &suite, const std::string &name) {
+    return (suite + "/" + name).find(Filter()) != std::string::npos;
+}
+
+// Keep the compiler from optimizing a computed value away
+template<class T>
+inline void DoNotOptimize(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+template<class F>
+inline double TimeNs(F &&fn) {
+    Clock::time_point start = Clock::now();
+    fn();
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+        .count();
+}
+
+/**
+ * @brief Print one result line
+ * @param nsPerOp Per-round ns/op, the median is reported along with min/max
+ * @param bytesPerOp Bytes processed per op, 0 if not a throughput benchmark
+ */
+inline void Report(const std::string &suite, const std::string &name,
+                   size_t iters, std::vector<double> nsPerOp,
+                   double bytesPerOp=0) {
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+    double median = nsPerOp[nsPerOp.size() / 2];
+    printf("{\"suite\":\"%s\",\"name\":\"%s\",\"iters\":%zu,\"rounds\":%zu,"
+           "\"ns_per_op\":%.2f,\"min_ns\":%.2f,\"max_ns\":%.2f,"
+           "\"ops_per_sec\":%.0f",
+           suite.c_str(), name.c_str(), iters, nsPerOp.size(), median,
+           nsPerOp.front(), nsPerOp.back(), median > 0 ? 1e9 / median : 0);
+    if (bytesPerOp > 0) {
+        printf(",\"mb_per_sec\":%.2f", bytesPerOp / median * 1e9 / 1048576);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * @brief Run fn(iters) for a warm-up round plus rounds timed rounds
+ * @param fn Callable doing iters iterations of the measured operation
+ */
+template<class F>
+inline void Run(const std::string &suite, const std::string &name,
+                size_t iters, F &&fn, double bytesPerOp=0, int rounds=5) {
+    if (!Selected(suite, name)) {
+        return;
+    }
+    fn(std::max<size_t>(1, iters / 10));
+    std::vector<double> nsPerOp;
+    for (int r = 0; r < rounds; r++) {
+        nsPerOp.push_back(TimeNs([&] { fn(iters); }) / iters);
+    }
+    Report(suite, name, iters, nsPerOp, bytesPerOp);
+}
+
+}  // namespace bench
@@ -0,0 +1,58 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "BlockDeque.hpp"
+
+// Uncontended push_back + pop_front on one thread
+void BenchPushPop() {
+    BlockDeque<std::string> deque(1024);
+    std::string item(64, 'x'), out;
+    bench::Run("blockdeque", "push_pop/single", 200000, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            deque.push_back(item);
+            deque.pop_front(out);
+        }
+    });
+}
+
+// producers push n items in total, consumers pop all of them
+void BenchContended(size_t producers, size_t consumers, size_t capacity) {
+    BlockDeque<std::string> deque(capacity);
+    std::string item(64, 'x');
+    bench::Run("blockdeque",
+               "contended/" + std::to_string(producers) + "p" +
+                   std::to_string(consumers) + "c/cap" +
+                   std::to_string(capacity),
+               100000, [&](size_t n) {
+        std::vector<std::thread> threads;
+        for (size_t c = 0; c < consumers; c++) {
+            threads.emplace_back([&, c] {
+                std::string out;
+                for (size_t i = c; i < n; i += consumers) {
+                    deque.pop_front(out);
+                }
+            });
+        }
+        for (size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&, p] {
+                for (size_t i = p; i < n; i += producers) {
+                    deque.push_back(item);
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    });
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    BenchPushPop();
+    BenchContended(1, 1, 1024);
+    BenchContended(4, 1, 1024);
+    BenchContended(4, 4, 1024);
+    BenchContended(4, 4, 16);
+}
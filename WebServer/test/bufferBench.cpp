@@ -0,0 +1,90 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+
+#include "bench.h"
+#include "buffer.h"
+
+void BenchAppend(size_t len) {
+    std::string data(len, 'x');
+    Buffer buff;
+    bench::Run("buffer", "append/" + std::to_string(len), 100000,
+               [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            buff.append(data);
+            buff.UpdateReadPtr(len);
+            if (buff.WritableBytes() < len) {
+                buff.InitPtr();
+            }
+        }
+    }, static_cast<double>(len));
+}
+
+// A response header sized append followed by a full reset, as HttpConn does
+void BenchAppendReset(size_t len) {
+    std::string data(len, 'x');
+    Buffer buff;
+    bench::Run("buffer", "append_initptr/" + std::to_string(len), 100000,
+               [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            buff.append(data);
+            bench::DoNotOptimize(buff.ReadPtr());
+            buff.InitPtr();
+        }
+    }, static_cast<double>(len));
+}
+
+void BenchRetrieveAllToStr(size_t len) {
+    std::string data(len, 'x');
+    Buffer buff;
+    bench::Run("buffer", "retrieve_all_to_str/" + std::to_string(len), 100000,
+               [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            buff.append(data);
+            std::string str = buff.RetrieveAllToStr();
+            bench::DoNotOptimize(str);
+        }
+    }, static_cast<double>(len));
+}
+
+// write() into a pipe then Buffer::ReadFd() it back
+void BenchReadFd(size_t len) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    std::string data(len, 'x');
+    Buffer buff;
+    int saveErrno = 0;
+    bench::Run("buffer", "readfd/" + std::to_string(len), 20000,
+               [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (write(fds[1], data.data(), len) < 0) {
+                perror("write");
+                return;
+            }
+            buff.ReadFd(fds[0], &saveErrno);
+            buff.UpdateReadPtr(buff.ReadableBytes());
+            if (buff.WritableBytes() < len) {
+                buff.InitPtr();
+            }
+        }
+    }, static_cast<double>(len));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    for (size_t len : {16, 256, 4096}) {
+        BenchAppend(len);
+    }
+    BenchAppendReset(256);
+    BenchAppendReset(4096);
+    BenchRetrieveAllToStr(128);
+    for (size_t len : {512, 4096, 32768}) {
+        BenchReadFd(len);
+    }
+}
@@ -0,0 +1,81 @@
+#include <string>
+
+#include "bench.h"
+#include "buffer.h"
+#include "httpRequest.h"
+#include "httpResponse.h"
+
+#ifndef RESOURCES_DIR
+#define RESOURCES_DIR "../resources/"
+#endif
+
+// What a desktop browser sends for a page load
+static const std::string BROWSER_GET =
+    "GET /picture HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8088\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://127.0.0.1:8088/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n";
+
+// Form post to a path without a database handler
+static const std::string FORM_POST =
+    "POST /search HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8088\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 29\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Origin: http://127.0.0.1:8088\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+    "\r\n"
+    "username=hellcat&password=123";
+
+void BenchParse(const std::string &name, const std::string &raw) {
+    Buffer buff;
+    HttpRequest request;
+    bench::Run("http", "parse/" + name, 2000, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            buff.append(raw);
+            request.Init();
+            bench::DoNotOptimize(request.parse(buff));
+            buff.InitPtr();
+        }
+    }, static_cast<double>(raw.size()));
+}
+
+void BenchMakeResponse(const std::string &name, std::string path) {
+    Buffer buff;
+    HttpResponse response;
+    bench::Run("http", "make_response/" + name, 20000, [&](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            response.Init(RESOURCES_DIR, path, true, 200);
+            response.MakeResponse(buff);
+            bench::DoNotOptimize(response.File());
+            response.UnmapFile();
+            buff.InitPtr();
+        }
+    });
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    BenchParse("browser_get", BROWSER_GET);
+    BenchParse("form_post", FORM_POST);
+    BenchMakeResponse("index_html", "/index.html");
+    BenchMakeResponse("jquery_js", "/js/jquery.js");
+    BenchMakeResponse("image_jpg", "/images/profile-image.jpg");
+    BenchMakeResponse("not_found", "/missing.html");
+}
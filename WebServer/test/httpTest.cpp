@@ -0,0 +1,323 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "httpRequest.h"
+#include "httpconn.h"
+#include "httpResponse.h"
+#include "router.h"
+
+#ifndef RESOURCES_DIR
+#define RESOURCES_DIR "../resources/"
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond)                                                    \
+    do {                                                               \
+        if (!(cond)) {                                                 \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,     \
+                    __LINE__, #cond);                                  \
+            failures++;                                                \
+        }                                                              \
+    } while (0)
+
+typedef HttpRequest::HTTP_CODE CODE;
+
+// Feed raw in pieces of at most step bytes, as separate reads would
+CODE ParseSplit(HttpRequest &request, Buffer &buff, const std::string &raw,
+                size_t step) {
+    CODE code = HttpRequest::NO_REQUEST;
+    for (size_t pos = 0; pos < raw.size(); pos += step) {
+        CHECK(code == HttpRequest::NO_REQUEST);
+        buff.append(raw.substr(pos, step));
+        code = request.parse(buff);
+    }
+    return code;
+}
+
+void TestSplitReads() {
+    const std::string raw =
+        "POST /login HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 29\r\n"
+        "\r\n"
+        "username=hellcat&password=123";
+    for (size_t step : {size_t(1), size_t(7), raw.size()}) {
+        Buffer buff;
+        HttpRequest request;
+        CHECK(ParseSplit(request, buff, raw, step) == HttpRequest::GET_REQUEST);
+        CHECK(request.method() == "POST");
+        CHECK(request.path() == "/login");
+        CHECK(request.IsKeepAlive());
+        CHECK(request.GetPostValueByKey("username") == "hellcat");
+        CHECK(request.GetPostValueByKey("password") == "123");
+        CHECK(buff.ReadableBytes() == 0);
+    }
+}
+
+void TestChunked() {
+    // Extensions and trailer fields are skipped, hex sizes in either case
+    const std::string raw =
+        "POST /upload HTTP/1.1\r\n"
+        "Transfer-Encoding: gzip, chunked\r\n"
+        "\r\n"
+        "5;name=value\r\nhello\r\n"
+        "A\r\n world and\r\n"
+        "b ; x\r\n more text!\r\n"
+        "0\r\n"
+        "X-Checksum: 1234\r\n"
+        "\r\n";
+    for (size_t step : {size_t(1), size_t(3), raw.size()}) {
+        Buffer buff;
+        HttpRequest request;
+        std::string body;
+        request.SetHeaderCallback([&body](HttpRequest &req) {
+            req.SetBodyCallback([&body](const char *data, size_t len) {
+                body.append(data, len);
+                return true;
+            });
+        });
+        CHECK(ParseSplit(request, buff, raw, step) == HttpRequest::GET_REQUEST);
+        CHECK(body == "hello world and more text!");
+    }
+
+    Buffer buff;
+    HttpRequest request;
+    buff.append("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "zz\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    request.Init();
+    buff.InitPtr();
+    // Chunk data longer than its size
+    buff.append("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "2\r\nabc\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    request.Init();
+    buff.InitPtr();
+    buff.append("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "fffffffffffffffff\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    request.Init();
+    buff.InitPtr();
+    buff.append("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    // Only whitespace or extensions may follow the size
+    for (const char *size : {"5zz", "5 garbage", "5\t x", "\xb5"}) {
+        request.Init();
+        buff.InitPtr();
+        buff.append(std::string("POST / HTTP/1.1\r\n"
+                                "Transfer-Encoding: chunked\r\n\r\n") +
+                    size + "\r\nhello\r\n0\r\n\r\n");
+        CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    }
+    for (const char *size : {"5 ", "5\t;a=b", "5;a"}) {
+        request.Init();
+        buff.InitPtr();
+        buff.append(std::string("POST / HTTP/1.1\r\n"
+                                "Transfer-Encoding: chunked\r\n\r\n") +
+                    size + "\r\nhello\r\n0\r\n\r\n");
+        CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    }
+}
+
+void TestContentLengthAndChunked() {
+    // Would be framed differently by a proxy that trusts Content-Length
+    Buffer buff;
+    HttpRequest request;
+    buff.append("POST / HTTP/1.1\r\n"
+                "Content-Length: 4\r\n"
+                "Transfer-Encoding: chunked\r\n"
+                "\r\n"
+                "0\r\n\r\n"
+                "GET /admin HTTP/1.1\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+
+    request.Init();
+    buff.InitPtr();
+    buff.append("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+}
+
+void TestTooLarge() {
+    size_t saved = HttpRequest::maxBodySize;
+    HttpRequest::maxBodySize = 8;
+    Buffer buff;
+    HttpRequest request;
+    buff.append("POST / HTTP/1.1\r\nContent-Length: 9\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::TOO_LARGE_REQUEST);
+
+    request.Init();
+    buff.InitPtr();
+    buff.append("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "5\r\n12345\r\n5\r\n67890\r\n0\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::TOO_LARGE_REQUEST);
+
+    // A body callback takes any size, and may refuse it
+    size_t received = 0;
+    request.Init();
+    buff.InitPtr();
+    request.SetHeaderCallback([&received](HttpRequest &req) {
+        req.SetBodyCallback([&received](const char*, size_t len) {
+            received += len;
+            return received <= 16;
+        });
+    });
+    buff.append("POST / HTTP/1.1\r\nContent-Length: 16\r\n\r\n"
+                "0123456789abcdef");
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    CHECK(received == 16);
+    buff.append("POST / HTTP/1.1\r\nContent-Length: 17\r\n\r\n"
+                "0123456789abcdefg");
+    CHECK(request.parse(buff) == HttpRequest::BAD_REQUEST);
+    HttpRequest::maxBodySize = saved;
+}
+
+void TestPipelining() {
+    Buffer buff;
+    HttpRequest request;
+    buff.append("POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+                "GET /b HTTP/1.1\r\nConnection: keep-alive\r\n\r\n"
+                "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "1\r\nx\r\n0\r\n\r\n"
+                "GET /d HTTP/1.1\r\n");
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    CHECK(request.path() == "/a");
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    CHECK(request.path() == "/b");
+    CHECK(request.IsKeepAlive());
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    CHECK(request.path() == "/c");
+    // The last one is not complete yet
+    CHECK(request.parse(buff) == HttpRequest::NO_REQUEST);
+    buff.append("\r\n");
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+    CHECK(request.path() == "/d");
+    CHECK(!request.IsKeepAlive());
+}
+
+void TestExpectContinue() {
+    Buffer buff;
+    HttpRequest request;
+    buff.append("POST / HTTP/1.1\r\nExpect: 100-continue\r\n"
+                "Content-Length: 2\r\n\r\n");
+    CHECK(request.parse(buff) == HttpRequest::NO_REQUEST);
+    CHECK(request.TakeExpectContinue());
+    CHECK(!request.TakeExpectContinue());
+    buff.append("ok");
+    CHECK(request.parse(buff) == HttpRequest::GET_REQUEST);
+}
+
+void TestEmptyFileRange() {
+    char dir[] = "/tmp/httpTestXXXXXX";
+    CHECK(mkdtemp(dir) != nullptr);
+    std::string srcDir = std::string(dir) + "/";
+    int fd = open((srcDir + "empty.txt").c_str(), O_CREAT | O_WRONLY, 0644);
+    CHECK(fd >= 0);
+    close(fd);
+    // No byte of an empty file can be selected, not even by a suffix
+    for (int64_t first : {int64_t(-1), int64_t(0)}) {
+        std::string path = "/empty.txt";
+        HttpResponse response;
+        response.Init(srcDir, path, false);
+        response.SetRanges({{first, 5}}, "");
+        Buffer buff;
+        response.MakeResponse(buff);
+        std::string out = buff.RetrieveAllToStr();
+        CHECK(response.Code() == 416);
+        CHECK(out.find("Content-Range: bytes */0\r\n") != std::string::npos);
+    }
+    unlink((srcDir + "empty.txt").c_str());
+    rmdir(dir);
+}
+
+// Write raw to a connection in pieces, as the event loop would drive it
+std::string Exchange(HttpConn &conn, int peer, const std::string &raw,
+                     size_t step) {
+    std::string out;
+    for (size_t pos = 0; pos < raw.size(); pos += step) {
+        std::string piece = raw.substr(pos, step);
+        CHECK(::write(peer, piece.data(), piece.size()) ==
+              static_cast<ssize_t>(piece.size()));
+        int err = 0;
+        CHECK(conn.read(&err) > 0);
+        while (conn.Handle()) {
+            while (conn.ToWriteBytes() > 0) {
+                CHECK(conn.write(&err) > 0);
+            }
+        }
+    }
+    char buf[4096];
+    ssize_t len;
+    while ((len = recv(peer, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        out.append(buf, len);
+    }
+    return out;
+}
+
+void TestUploadRoute() {
+    size_t saved = HttpRequest::maxBodySize;
+    HttpRequest::maxBodySize = 8;
+    HttpConn::srcDir = RESOURCES_DIR;
+    Router::Instance()->AddUpload(Router::POST, "/upload/:name",
+        [](const HttpRequest&, const Router::Params&) {
+            auto size = std::make_shared<size_t>(0);
+            Router::Upload upload;
+            upload.onBody = [size](const char*, size_t len) {
+                *size += len;
+                return true;
+            };
+            upload.onDone = [size](const HttpRequest&, const Router::Params &p,
+                                   Router::Reply &reply) {
+                reply.type = "text/plain";
+                reply.body = Router::Param(p, "name") + " " +
+                             std::to_string(*size);
+            };
+            return upload;
+        });
+
+    int sv[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    HttpConn conn;
+    sockaddr_in addr = {};
+    conn.Init(sv[0], addr);
+    std::string body(100000, 'x');
+    std::string out = Exchange(conn, sv[1],
+        "POST /upload/big HTTP/1.1\r\nConnection: keep-alive\r\n"
+        "Content-Length: 100000\r\n\r\n" + body, 4096);
+    CHECK(out.find("HTTP/1.1 200") == 0);
+    CHECK(out.find("\r\n\r\nbig 100000") != std::string::npos);
+
+    // Other routes still buffer, and are still limited
+    out = Exchange(conn, sv[1],
+        "POST /login HTTP/1.1\r\nContent-Length: 9\r\n\r\n123456789", 5);
+    CHECK(out.find("HTTP/1.1 413") == 0);
+    conn.Close();
+    close(sv[1]);
+    Router::Instance()->Clear();
+    HttpRequest::maxBodySize = saved;
+}
+
+int main() {
+    TestSplitReads();
+    TestChunked();
+    TestContentLengthAndChunked();
+    TestTooLarge();
+    TestPipelining();
+    TestExpectContinue();
+    TestEmptyFileRange();
+    TestUploadRoute();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("httpTest passed\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "log.h"
+
+// Log::write alone, the file is flushed by the stdio buffer
+void BenchWrite(const char *mode) {
+    bench::Run("log", std::string("write/") + mode, 100000, [](size_t n) {
+        Log *log = Log::Instance();
+        for (size_t i = 0; i < n; i++) {
+            log->write(1, "Client[%d](%s:%d) in, userCount:%d", 12,
+                       "127.0.0.1", 50122, static_cast<int>(i));
+        }
+    });
+}
+
+// LOG_INFO as used on the request path: level check, write and flush
+void BenchMacro(const char *mode) {
+    bench::Run("log", std::string("log_info/") + mode, 100000, [](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            LOG_INFO("Client[%d](%s:%d) in, userCount:%d", 12, "127.0.0.1",
+                     50122, static_cast<int>(i));
+        }
+    });
+}
+
+// Below the log level, the common case for LOG_DEBUG in production
+void BenchFiltered() {
+    bench::Run("log", "log_debug_filtered", 1000000, [](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            LOG_DEBUG("filesize:%d, %d  to %d", 1, 2, static_cast<int>(i));
+        }
+    });
+}
+
+void BenchThreads(const char *mode, size_t threadNum) {
+    bench::Run("log",
+               std::string("log_info_threads/") + mode + "/" +
+                   std::to_string(threadNum),
+               100000, [threadNum](size_t n) {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadNum; t++) {
+            threads.emplace_back([n, threadNum] {
+                for (size_t i = 0; i < n / threadNum; i++) {
+                    LOG_INFO("PID:[%04d]======= %05d =========", 1,
+                             static_cast<int>(i));
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    });
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    Log::Instance()->Init(1, "./benchlog", ".log", 0);
+    BenchWrite("sync");
+    BenchMacro("sync");
+    BenchFiltered();
+    BenchThreads("sync", 4);
+
+    Log::Instance()->Init(1, "./benchlog", ".log", 1024);
+    BenchWrite("async");
+    BenchMacro("async");
+    BenchThreads("async", 4);
+}
@@ -0,0 +1,59 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "ThreadPool.hpp"
+
+// AddTask from one producer, time until every task has run
+void BenchAddTask(size_t threadNum) {
+    ThreadPool pool(threadNum);
+    std::atomic<size_t> done{0};
+    bench::Run("threadpool", "add_task/" + std::to_string(threadNum), 100000,
+               [&](size_t n) {
+        done = 0;
+        for (size_t i = 0; i < n; i++) {
+            pool.AddTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+        }
+        while (done.load() < n) {
+            std::this_thread::yield();
+        }
+    });
+}
+
+// Several producers, as when the loop and workers both enqueue
+void BenchAddTaskContended(size_t threadNum, size_t producers) {
+    ThreadPool pool(threadNum);
+    std::atomic<size_t> done{0};
+    bench::Run("threadpool",
+               "add_task_contended/" + std::to_string(threadNum) + "x" +
+                   std::to_string(producers),
+               100000, [&](size_t n) {
+        done = 0;
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&, p] {
+                for (size_t i = p; i < n; i += producers) {
+                    pool.AddTask([&done] {
+                        done.fetch_add(1, std::memory_order_relaxed);
+                    });
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        while (done.load() < n) {
+            std::this_thread::yield();
+        }
+    });
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    for (size_t threadNum : {1, 4, 8}) {
+        BenchAddTask(threadNum);
+    }
+    BenchAddTaskContended(4, 4);
+}
@@ -0,0 +1,117 @@
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "heaptimer.h"
+#include "quadheaptimer.h"
+
+struct Round {
+    double addNs;
+    double adjustNs;
+    double tickNs;
+};
+
+// Random timeouts in the future for add/adjust, so nothing expires early
+static std::vector<int> Timeouts(size_t n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> dist(60000, 120000);
+    std::vector<int> timeouts(n);
+    for (auto &t : timeouts) {
+        t = dist(rng);
+    }
+    return timeouts;
+}
+
+Round BenchHeapTimer(size_t n) {
+    Round res{0, 0, 0};
+    std::vector<int> timeouts = Timeouts(n, 1);
+    std::vector<int> extends = Timeouts(n, 2);
+    HeapTimer timer;
+    size_t fired = 0;
+
+    res.addNs = bench::TimeNs([&] {
+        for (size_t i = 0; i < n; i++) {
+            timer.addTimer(static_cast<int>(i), timeouts[i],
+                           [&fired] { fired++; });
+        }
+    });
+    res.adjustNs = bench::TimeNs([&] {
+        for (size_t i = 0; i < n; i++) {
+            timer.adjust(static_cast<int>(i), timeouts[i] + extends[i]);
+        }
+    });
+    // Expire everything: re-add with timeout 0 then tick once
+    for (size_t i = 0; i < n; i++) {
+        timer.addTimer(static_cast<int>(i), 0, [&fired] { fired++; });
+    }
+    res.tickNs = bench::TimeNs([&] { timer.tick(); });
+    if (fired != n) {
+        fprintf(stderr, "HeapTimer fired %zu of %zu\n", fired, n);
+    }
+    return res;
+}
+
+static void OnQuadTimeout(void *ctx) {
+    (*static_cast<size_t*>(ctx))++;
+}
+
+Round BenchQuadHeapTimer(size_t n) {
+    Round res{0, 0, 0};
+    std::vector<int> timeouts = Timeouts(n, 1);
+    std::vector<int> extends = Timeouts(n, 2);
+    QuadHeapTimer timer;
+    size_t fired = 0;
+    std::unique_ptr<TimerHook[]> hooks(new TimerHook[n]);
+    for (size_t i = 0; i < n; i++) {
+        hooks[i].cb = OnQuadTimeout;
+        hooks[i].ctx = &fired;
+    }
+
+    res.addNs = bench::TimeNs([&] {
+        for (size_t i = 0; i < n; i++) {
+            timer.add(&hooks[i], timeouts[i]);
+        }
+    });
+    res.adjustNs = bench::TimeNs([&] {
+        for (size_t i = 0; i < n; i++) {
+            timer.adjust(&hooks[i], timeouts[i] + extends[i]);
+        }
+    });
+    for (size_t i = 0; i < n; i++) {
+        timer.add(&hooks[i], 0);
+    }
+    res.tickNs = bench::TimeNs([&] { timer.tick(); });
+    if (fired != n) {
+        fprintf(stderr, "QuadHeapTimer fired %zu of %zu\n", fired, n);
+    }
+    return res;
+}
+
+template<class F>
+void Bench(const std::string &name, size_t n, int rounds, F &&fn) {
+    if (!bench::Selected("timer", name)) {
+        return;
+    }
+    std::vector<double> add, adjust, tick;
+    for (int r = 0; r < rounds; r++) {
+        Round res = fn(n);
+        add.push_back(res.addNs / n);
+        adjust.push_back(res.adjustNs / n);
+        tick.push_back(res.tickNs / n);
+    }
+    std::string suffix = "/" + std::to_string(n);
+    bench::Report("timer", name + "/add" + suffix, n, add);
+    bench::Report("timer", name + "/adjust" + suffix, n, adjust);
+    bench::Report("timer", name + "/tick" + suffix, n, tick);
+}
+
+int main(int argc, char *argv[]) {
+    bench::Init(argc, argv);
+    for (size_t n : {10000, 100000, 1000000}) {
+        int rounds = n >= 1000000 ? 1 : 3;
+        Bench("HeapTimer", n, rounds, BenchHeapTimer);
+        Bench("QuadHeapTimer", n, rounds, BenchQuadHeapTimer);
+    }
+}
@@ -1,20 +1,18 @@
 // Fixme: change to std::priority_queue
 #include <cassert>
-#include <iostream>
 
 #include "heaptimer.h"
 using namespace std;
 
 void HeapTimer::siftUp_(size_t i) {
     assert(i >= 0 && i < heap_.size());
-    size_t j = (i - 1) / 2;
-    while (j >= 0) {
+    while (i > 0) {
+        size_t j = (i - 1) / 2;
         if (heap_[j] < heap_[i]) {
             break;
         }
         swapNode_(i, j);
         i = j;
-        j = (i - 1) / 2;
     }
 }
 
@@ -44,7 +42,6 @@ bool HeapTimer::siftdown_(size_t index, size_t n) {
 }
 
 void HeapTimer::addTimer(int fd, int timeout, const TimeoutCallBack& cb) {
-    cout << "call add Timer" << endl;
     assert(fd >= 0);
     size_t i;
     if (ref_.count(fd) == 0) {
@@ -53,9 +50,7 @@ void HeapTimer::addTimer(int fd, int timeout, const TimeoutCallBack& cb) {
         ref_[fd] = i;
         heap_.push_back({fd, Clock::now() + MS(timeout), cb});
         siftUp_(i);
-        cout << "push_back: " << heap_.size() << endl;
     } else {
-        cout << "нڵ" << endl;
         // ýڵнڵ, ֻҪ
         i = ref_[fd];
         heap_[i].expires = Clock::now() + MS(timeout);
@@ -67,12 +62,9 @@ void HeapTimer::addTimer(int fd, int timeout, const TimeoutCallBack& cb) {
 }
 
 void HeapTimer::doWork(int fd) {
-    cout << "Call Dowork" << endl;
     if (heap_.empty() || ref_.count(fd) == 0) {
-        cout << "Not found in heap " << endl;
         return;
     }
-    cout << "Found " << endl;
     size_t i = ref_[fd];
     TimerNode node = heap_[i];
     del_(i);
@@ -108,8 +100,6 @@ void HeapTimer::tick() {
     if (heap_.empty()) {
         return;
     }
-    // if (heap_.size() != 4090)
-    //     cout << heap_.size() << endl;
     while (heap_.size()) {
         TimerNode node = heap_.front();
         if (std::chrono::duration_cast<MS>(node.expires - Clock::now())
@@ -119,7 +109,6 @@ void HeapTimer::tick() {
         node.cb();
         assert(heap_.size());
         pop();
-        cout << "In pop, " << heap_.size() << endl;
     }
 }
 
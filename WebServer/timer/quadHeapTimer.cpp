@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cassert>
+
+#include "quadheaptimer.h"
+using namespace std;
+
+void QuadHeapTimer::place_(size_t i, const Node &node) {
+    heap_[i] = node;
+    node.hook->index = i;
+}
+
+void QuadHeapTimer::siftUp_(size_t i) {
+    assert(i < heap_.size());
+    Node node = heap_[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / D;
+        if (!(node.expires < heap_[parent].expires)) {
+            break;
+        }
+        place_(i, heap_[parent]);
+        i = parent;
+    }
+    place_(i, node);
+}
+
+void QuadHeapTimer::siftDown_(size_t i) {
+    assert(i < heap_.size());
+    size_t n = heap_.size();
+    Node node = heap_[i];
+    while (true) {
+        size_t first = i * D + 1;
+        if (first >= n) {
+            break;
+        }
+        // Find the earliest of up to four children
+        size_t last = min(first + D, n);
+        size_t child = first;
+        for (size_t j = first + 1; j < last; j++) {
+            if (heap_[j].expires < heap_[child].expires) {
+                child = j;
+            }
+        }
+        if (!(heap_[child].expires < node.expires)) {
+            break;
+        }
+        place_(i, heap_[child]);
+        i = child;
+    }
+    place_(i, node);
+}
+
+void QuadHeapTimer::add(TimerHook *hook, int timeoutMS) {
+    add(hook, Clock::now() + MS(timeoutMS));
+}
+
+void QuadHeapTimer::add(TimerHook *hook, TimeStamp expires) {
+    assert(hook);
+    if (!hook->linked()) {
+        heap_.push_back({expires, hook});
+        hook->index = heap_.size() - 1;
+        siftUp_(hook->index);
+        return;
+    }
+    size_t i = hook->index;
+    assert(i < heap_.size() && heap_[i].hook == hook);
+    bool earlier = expires < heap_[i].expires;
+    heap_[i].expires = expires;
+    if (earlier) {
+        siftUp_(i);
+    } else {
+        siftDown_(i);
+    }
+}
+
+void QuadHeapTimer::del_(size_t i) {
+    assert(i < heap_.size());
+    TimerHook *hook = heap_[i].hook;
+    Node last = heap_.back();
+    heap_.pop_back();
+    hook->index = TimerHook::npos;
+    if (i < heap_.size()) {
+        // Move the tail into the hole and restore heap order
+        bool earlier = last.expires < heap_[i].expires;
+        place_(i, last);
+        if (earlier) {
+            siftUp_(i);
+        } else {
+            siftDown_(i);
+        }
+    }
+}
+
+void QuadHeapTimer::remove(TimerHook *hook) {
+    assert(hook);
+    if (hook->linked()) {
+        del_(hook->index);
+    }
+}
+
+size_t QuadHeapTimer::PopExpired(vector<TimerHook*> &expired) {
+    expired.clear();
+    if (heap_.empty()) {
+        return 0;
+    }
+    TimeStamp now = Clock::now();
+    while (!heap_.empty() && !(now < heap_.front().expires)) {
+        expired.push_back(heap_.front().hook);
+        del_(0);
+    }
+    return expired.size();
+}
+
+size_t QuadHeapTimer::tick() {
+    // Pop the whole expired batch first, callbacks may touch the heap
+    size_t cnt = PopExpired(expired_);
+    for (size_t i = 0; i < cnt; i++) {
+        TimerHook *hook = expired_[i];
+        assert(hook->cb);
+        // Skip hooks re-scheduled by an earlier callback of this batch
+        if (!hook->linked()) {
+            hook->cb(hook->ctx);
+        }
+    }
+    return cnt;
+}
+
+int QuadHeapTimer::GetNextTick() {
+    tick();
+    return NextTickMS();
+}
+
+int QuadHeapTimer::NextTickMS() const {
+    if (heap_.empty()) {
+        return -1;
+    }
+    return static_cast<int>(max<Clock::rep>(
+        0, chrono::duration_cast<MS>(heap_.front().expires - Clock::now())
+               .count()));
+}
+
+void QuadHeapTimer::clear() {
+    for (Node &node : heap_) {
+        node.hook->index = TimerHook::npos;
+    }
+    heap_.clear();
+}
@@ -0,0 +1,871 @@
+/*
+ * httpbench - keep-alive aware, epoll driven HTTP load generator
+ *
+ * Unlike webbench (one forked process per client, one TCP connection per
+ * request) every thread drives many non-blocking connections from its own
+ * epoll loop. Supports keep-alive, pipelining, fixed request-rate (open
+ * loop) mode, mixed URL lists with POST bodies, and reports latency
+ * percentiles from a log-linear (HDR style) histogram.
+ *
+ * Usage:
+ *   httpbench [options] http://host:port/path
+ *   httpbench --help
+ *
+ * Return codes:
+ *    0 - success
+ *    1 - benchmark failed (no response at all)
+ *    2 - bad param
+ */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+/*
+ * Log-linear latency histogram in microseconds: values are grouped by
+ * power of two, each power split into SUB_BUCKETS linear buckets, which
+ * keeps the relative error below 1 / SUB_BUCKETS like HdrHistogram.
+ */
+class Histogram {
+public:
+    static const int SUB_BITS = 7;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAGNITUDES = 40;  // Up to 2^40 us
+
+    Histogram() : counts_((MAGNITUDES + 1) * SUB_BUCKETS, 0) {}
+
+    void Record(uint64_t us) {
+        counts_[Index_(us)]++;
+        total_++;
+        sum_ += us;
+        max_ = max(max_, us);
+        min_ = min(min_, us);
+    }
+
+    void Merge(const Histogram &other) {
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = max(max_, other.max_);
+        min_ = min(min_, other.min_);
+    }
+
+    uint64_t Percentile(double p) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(ceil(p / 100.0 * total_));
+        rank = max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return min(Value_(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t Count() const { return total_; }
+    uint64_t Max() const { return total_ ? max_ : 0; }
+    uint64_t Min() const { return total_ ? min_ : 0; }
+    double Mean() const { return total_ ? double(sum_) / total_ : 0; }
+
+private:
+    static size_t Index_(uint64_t v) {
+        if (v < SUB_BUCKETS) {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS + 1;
+        size_t magnitude = min(shift, MAGNITUDES);
+        uint64_t sub = (v >> shift) & (SUB_BUCKETS / 2 - 1);
+        return magnitude * SUB_BUCKETS + SUB_BUCKETS / 2 + sub;
+    }
+
+    // Highest value that maps to bucket i
+    static uint64_t Value_(size_t i) {
+        size_t magnitude = i / SUB_BUCKETS;
+        uint64_t sub = i % SUB_BUCKETS;
+        if (magnitude == 0) {
+            return sub;
+        }
+        return ((sub + 1) << magnitude) - 1;
+    }
+
+    vector<uint64_t> counts_;
+    uint64_t total_{0};
+    uint64_t sum_{0};
+    uint64_t max_{0};
+    uint64_t min_{UINT64_MAX};
+};
+
+struct Target {
+    string method;
+    string path;
+    string body;
+    string raw;  // Prebuilt request bytes
+};
+
+struct Options {
+    string host;
+    string port{"80"};
+    int threads{1};
+    int connections{10};
+    int duration{10};
+    int pipeline{1};
+    double rate{0};         // Total requests per second, 0 = closed loop
+    bool keepAlive{true};
+    bool json{false};
+    vector<string> headers;
+    vector<Target> targets;
+};
+
+struct Stats {
+    uint64_t requests{0};
+    uint64_t responses{0};
+    uint64_t status[6]{0};  // 1xx..5xx, [0] unparsable
+    uint64_t connects{0};
+    uint64_t connectErrors{0};
+    uint64_t readErrors{0};
+    uint64_t writeErrors{0};
+    uint64_t lost{0};       // In flight when the connection closed
+    uint64_t bytesIn{0};
+    uint64_t bytesOut{0};
+    uint64_t backlogMax{0}; // Open loop: requests waiting for a connection
+    Histogram latency;
+
+    void Merge(const Stats &o) {
+        requests += o.requests;
+        responses += o.responses;
+        for (int i = 0; i < 6; i++) {
+            status[i] += o.status[i];
+        }
+        connects += o.connects;
+        connectErrors += o.connectErrors;
+        readErrors += o.readErrors;
+        writeErrors += o.writeErrors;
+        lost += o.lost;
+        bytesIn += o.bytesIn;
+        bytesOut += o.bytesOut;
+        backlogMax = max(backlogMax, o.backlogMax);
+        latency.Merge(o.latency);
+    }
+};
+
+/*
+ * Incremental HTTP/1.1 response parser. Handles Content-Length, chunked
+ * and read-until-close bodies across arbitrary read boundaries.
+ */
+class ResponseParser {
+public:
+    enum RESULT { NEED_MORE, DONE, BAD };
+
+    void Reset() {
+        state_ = HEAD;
+        status_ = 0;
+        remain_ = 0;
+        close_ = false;
+    }
+
+    // Consume from data, set used to the bytes that belong to this response
+    RESULT Feed(const char *data, size_t len, size_t &used) {
+        used = 0;
+        while (used < len || state_ == COMPLETE) {
+            switch (state_) {
+            case HEAD: {
+                head_.append(data + used, len - used);
+                size_t end = head_.find("\r\n\r\n");
+                if (end == string::npos) {
+                    used = len;
+                    if (head_.size() > 64 * 1024) {
+                        return BAD;
+                    }
+                    return NEED_MORE;
+                }
+                // Only the part up to the blank line belongs to the head
+                size_t before = head_.size() - (len - used);
+                used += end + 4 - before;
+                if (!ParseHead_(head_.substr(0, end + 2))) {
+                    return BAD;
+                }
+                head_.clear();
+                break;
+            }
+            case BODY: {
+                size_t n = min<uint64_t>(remain_, len - used);
+                used += n;
+                remain_ -= n;
+                if (remain_ == 0) {
+                    state_ = COMPLETE;
+                }
+                break;
+            }
+            case UNTIL_CLOSE:
+                used = len;
+                return NEED_MORE;
+            case CHUNK_SIZE:
+            case CHUNK_CRLF:
+            case TRAILER: {
+                const char *nl = static_cast<const char*>(
+                    memchr(data + used, '\n', len - used));
+                size_t n = nl ? nl - (data + used) + 1 : len - used;
+                line_.append(data + used, n);
+                used += n;
+                if (!nl) {
+                    return NEED_MORE;
+                }
+                if (state_ == CHUNK_SIZE) {
+                    remain_ = strtoull(line_.c_str(), nullptr, 16);
+                    state_ = remain_ ? CHUNK_DATA : TRAILER;
+                } else if (state_ == CHUNK_CRLF) {
+                    state_ = CHUNK_SIZE;
+                } else if (line_ == "\r\n" || line_ == "\n") {
+                    state_ = COMPLETE;
+                }
+                line_.clear();
+                break;
+            }
+            case CHUNK_DATA: {
+                size_t n = min<uint64_t>(remain_, len - used);
+                used += n;
+                remain_ -= n;
+                if (remain_ == 0) {
+                    state_ = CHUNK_CRLF;
+                }
+                break;
+            }
+            case COMPLETE:
+                return DONE;
+            }
+        }
+        return state_ == COMPLETE ? DONE : NEED_MORE;
+    }
+
+    // Peer closed: a read-until-close body is complete now
+    bool FinishOnClose() {
+        return state_ == UNTIL_CLOSE;
+    }
+
+    int Status() const { return status_; }
+    bool Close() const { return close_; }
+
+private:
+    enum STATE {
+        HEAD, BODY, UNTIL_CLOSE, CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF,
+        TRAILER, COMPLETE
+    };
+
+    bool ParseHead_(const string &head) {
+        if (head.compare(0, 5, "HTTP/") != 0) {
+            return false;
+        }
+        size_t sp = head.find(' ');
+        if (sp == string::npos) {
+            return false;
+        }
+        status_ = atoi(head.c_str() + sp + 1);
+        bool hasLength = false, chunked = false;
+        bool http10 = head.compare(0, 8, "HTTP/1.0") == 0;
+        close_ = http10;
+        size_t pos = head.find("\r\n") + 2;
+        while (pos < head.size()) {
+            size_t end = head.find("\r\n", pos);
+            string line = head.substr(pos, end - pos);
+            pos = end + 2;
+            size_t colon = line.find(':');
+            if (colon == string::npos) {
+                continue;
+            }
+            string name = line.substr(0, colon);
+            string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (name == "content-length") {
+                hasLength = true;
+                remain_ = strtoull(value.c_str(), nullptr, 10);
+            } else if (name == "transfer-encoding") {
+                chunked = value.find("chunked") != string::npos;
+            } else if (name == "connection") {
+                if (value.find("close") != string::npos) {
+                    close_ = true;
+                } else if (value.find("keep-alive") != string::npos) {
+                    close_ = false;
+                }
+            }
+        }
+        if (status_ == 204 || status_ == 304 || status_ / 100 == 1) {
+            state_ = COMPLETE;
+        } else if (chunked) {
+            state_ = CHUNK_SIZE;
+        } else if (hasLength) {
+            state_ = remain_ ? BODY : COMPLETE;
+        } else {
+            state_ = UNTIL_CLOSE;
+            close_ = true;
+        }
+        return true;
+    }
+
+    STATE state_{HEAD};
+    int status_{0};
+    uint64_t remain_{0};
+    bool close_{false};
+    string head_;
+    string line_;
+};
+
+struct Conn {
+    int fd{-1};
+    bool connecting{false};
+    bool wantOut{true};  // EPOLLOUT currently in the interest set
+    string out;
+    size_t outPos{0};
+    deque<Clock::time_point> inflight;  // Intended start of each request
+    ResponseParser parser;
+};
+
+class Worker {
+public:
+    Worker(const Options &opt, const sockaddr_storage &addr, socklen_t addrLen,
+           int connNum, double rate, unsigned seed)
+        : opt_(opt), addr_(addr), addrLen_(addrLen), conns_(connNum),
+          rate_(rate), next_(seed % max<size_t>(1, opt.targets.size())) {}
+
+    void Run(Clock::time_point start, Clock::time_point end) {
+        epollFd_ = epoll_create1(0);
+        for (size_t i = 0; i < conns_.size(); i++) {
+            Connect_(i);
+        }
+        Clock::time_point due = start;
+        vector<epoll_event> events(256);
+        while (Clock::now() < end) {
+            int timeout = 100;
+            if (rate_ > 0) {
+                // Open loop: queue every request whose intended time passed
+                Clock::time_point now = Clock::now();
+                auto interval = chrono::duration_cast<Clock::duration>(
+                    chrono::duration<double>(1.0 / rate_));
+                while (due <= now) {
+                    backlog_.push_back(due);
+                    due += interval;
+                }
+                stats_.backlogMax = max<uint64_t>(stats_.backlogMax,
+                                                  backlog_.size());
+                Dispatch_();
+                timeout = 1;
+            }
+            int n = epoll_wait(epollFd_, events.data(),
+                               static_cast<int>(events.size()), timeout);
+            for (int i = 0; i < n; i++) {
+                size_t idx = events[i].data.u64;
+                if (events[i].events & (EPOLLOUT)) {
+                    OnWritable_(idx);
+                }
+                if (conns_[idx].fd >= 0 &&
+                    events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    OnReadable_(idx);
+                }
+            }
+        }
+        for (size_t i = 0; i < conns_.size(); i++) {
+            if (conns_[i].fd >= 0) {
+                close(conns_[i].fd);
+            }
+        }
+        close(epollFd_);
+    }
+
+    const Stats &GetStats() const { return stats_; }
+
+private:
+    void Connect_(size_t idx) {
+        Conn &c = conns_[idx];
+        c = Conn();
+        c.fd = socket(addr_.ss_family,
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) {
+            stats_.connectErrors++;
+            return;
+        }
+        int on = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        int ret = connect(c.fd, reinterpret_cast<sockaddr*>(&addr_), addrLen_);
+        if (ret < 0 && errno != EINPROGRESS) {
+            stats_.connectErrors++;
+            close(c.fd);
+            c.fd = -1;
+            return;
+        }
+        c.connecting = true;
+        stats_.connects++;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = idx;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, c.fd, &ev);
+        if (rate_ <= 0) {
+            // Closed loop: keep the pipeline full from the start
+            Fill_(idx, Clock::now());
+        }
+    }
+
+    void Close_(size_t idx, bool reconnect) {
+        Conn &c = conns_[idx];
+        stats_.lost += c.inflight.size();
+        if (c.fd >= 0) {
+            close(c.fd);  // Also removes it from epoll
+        }
+        c.fd = -1;
+        if (reconnect) {
+            Connect_(idx);
+        }
+    }
+
+    size_t Capacity_(const Conn &c) const {
+        size_t depth = opt_.keepAlive ? opt_.pipeline : 1;
+        return c.fd < 0 || c.inflight.size() >= depth
+                   ? 0 : depth - c.inflight.size();
+    }
+
+    void Enqueue_(size_t idx, Clock::time_point intended) {
+        Conn &c = conns_[idx];
+        const Target &t = opt_.targets[next_++ % opt_.targets.size()];
+        c.out += t.raw;
+        c.inflight.push_back(intended);
+        stats_.requests++;
+    }
+
+    void Fill_(size_t idx, Clock::time_point intended) {
+        for (size_t n = Capacity_(conns_[idx]); n > 0; n--) {
+            Enqueue_(idx, intended);
+        }
+        Flush_(idx);
+    }
+
+    // Open loop: hand backlog to connections with free pipeline slots
+    void Dispatch_() {
+        for (size_t i = 0; i < conns_.size() && !backlog_.empty(); i++) {
+            size_t idx = (rr_ + i) % conns_.size();
+            size_t n = Capacity_(conns_[idx]);
+            if (n == 0 || conns_[idx].connecting) {
+                continue;
+            }
+            for (; n > 0 && !backlog_.empty(); n--) {
+                Enqueue_(idx, backlog_.front());
+                backlog_.pop_front();
+            }
+            Flush_(idx);
+        }
+        rr_++;
+    }
+
+    void Flush_(size_t idx) {
+        Conn &c = conns_[idx];
+        if (c.fd < 0 || c.connecting) {
+            return;
+        }
+        while (c.outPos < c.out.size()) {
+            ssize_t n = write(c.fd, c.out.data() + c.outPos,
+                              c.out.size() - c.outPos);
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    stats_.writeErrors++;
+                    Close_(idx, true);
+                    return;
+                }
+                break;
+            }
+            c.outPos += n;
+            stats_.bytesOut += n;
+        }
+        if (c.outPos == c.out.size()) {
+            c.out.clear();
+            c.outPos = 0;
+        }
+        // Only ask for EPOLLOUT while there is something left to send
+        bool wantOut = !c.out.empty();
+        if (wantOut != c.wantOut) {
+            epoll_event ev{};
+            ev.events = wantOut ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            ev.data.u64 = idx;
+            epoll_ctl(epollFd_, EPOLL_CTL_MOD, c.fd, &ev);
+            c.wantOut = wantOut;
+        }
+    }
+
+    void OnWritable_(size_t idx) {
+        Conn &c = conns_[idx];
+        if (c.connecting) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) {
+                stats_.connectErrors++;
+                stats_.requests -= c.inflight.size();
+                c.inflight.clear();
+                Close_(idx, true);
+                return;
+            }
+            c.connecting = false;
+        }
+        Flush_(idx);
+    }
+
+    void Complete_(size_t idx) {
+        Conn &c = conns_[idx];
+        Clock::time_point now = Clock::now();
+        uint64_t us = chrono::duration_cast<chrono::microseconds>(
+            now - c.inflight.front()).count();
+        c.inflight.pop_front();
+        stats_.latency.Record(us);
+        stats_.responses++;
+        int cls = c.parser.Status() / 100;
+        stats_.status[cls >= 1 && cls <= 5 ? cls : 0]++;
+        bool close = c.parser.Close() || !opt_.keepAlive;
+        c.parser.Reset();
+        if (close) {
+            Close_(idx, true);
+        } else if (rate_ <= 0) {
+            Fill_(idx, now);
+        }
+    }
+
+    void OnReadable_(size_t idx) {
+        char buf[64 * 1024];
+        while (conns_[idx].fd >= 0) {
+            Conn &c = conns_[idx];
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n == 0) {
+                if (!c.inflight.empty() && c.parser.FinishOnClose()) {
+                    // Body delimited by close, Complete_ reconnects
+                    Complete_(idx);
+                } else {
+                    Close_(idx, true);
+                }
+                return;
+            } else if (n < 0) {
+                if (errno != EAGAIN) {
+                    stats_.readErrors++;
+                    Close_(idx, true);
+                }
+                return;
+            }
+            stats_.bytesIn += n;
+            size_t off = 0;
+            while (off < static_cast<size_t>(n) && conns_[idx].fd >= 0) {
+                Conn &cc = conns_[idx];
+                if (cc.inflight.empty()) {
+                    // Unsolicited bytes, the peer is confused
+                    stats_.readErrors++;
+                    Close_(idx, true);
+                    return;
+                }
+                size_t used = 0;
+                ResponseParser::RESULT res =
+                    cc.parser.Feed(buf + off, n - off, used);
+                off += used;
+                if (res == ResponseParser::BAD) {
+                    stats_.readErrors++;
+                    Close_(idx, true);
+                    return;
+                } else if (res == ResponseParser::DONE) {
+                    Complete_(idx);
+                }
+            }
+        }
+    }
+
+    const Options &opt_;
+    sockaddr_storage addr_;
+    socklen_t addrLen_;
+    vector<Conn> conns_;
+    double rate_;
+    size_t next_;
+    size_t rr_{0};
+    int epollFd_{-1};
+    deque<Clock::time_point> backlog_;
+    Stats stats_;
+};
+
+static void usage() {
+    fprintf(stderr,
+        "httpbench [option]... URL\n"
+        "  -t|--threads <n>       Worker threads. Default 1.\n"
+        "  -c|--connections <n>   Total connections. Default 10.\n"
+        "  -d|--duration <sec>    Run benchmark for <sec> seconds. Default 10.\n"
+        "  -p|--pipeline <n>      Requests in flight per connection. Default 1.\n"
+        "  -r|--rate <n>          Open loop: total requests/s, latency is measured\n"
+        "                         from the intended send time. Default closed loop.\n"
+        "  -C|--close             New connection per request (Connection: close).\n"
+        "  -m|--method <method>   Method for URL. Default GET, POST with --body.\n"
+        "  -b|--body <data>       Request body, @file reads it from a file.\n"
+        "  -H|--header <h: v>     Extra request header, may repeat.\n"
+        "  -u|--urls <file>       Mixed targets, one per line:\n"
+        "                         [METHOD] PATH [BODY|@file]\n"
+        "  -j|--json              Machine readable summary.\n"
+        "  -?|-h|--help           This information.\n");
+}
+
+static string ReadFile(const string &path) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        fprintf(stderr, "Cannot read %s\n", path.c_str());
+        exit(2);
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static string BodyArg(const string &arg) {
+    return !arg.empty() && arg[0] == '@' ? ReadFile(arg.substr(1)) : arg;
+}
+
+static void BuildRequest(const Options &opt, Target &t) {
+    string req = t.method + " " + t.path + " HTTP/1.1\r\n";
+    req += "Host: " + opt.host + ":" + opt.port + "\r\n";
+    req += opt.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    req += "User-Agent: httpbench\r\n";
+    for (const string &h : opt.headers) {
+        req += h + "\r\n";
+    }
+    if (!t.body.empty() || t.method == "POST" || t.method == "PUT") {
+        if (!t.body.empty() && t.body.find('=') != string::npos) {
+            req += "Content-Type: application/x-www-form-urlencoded\r\n";
+        }
+        req += "Content-Length: " + to_string(t.body.size()) + "\r\n";
+    }
+    req += "\r\n" + t.body;
+    t.raw = req;
+}
+
+// http://host[:port][/path]
+static bool ParseUrl(const string &url, Options &opt, string &path) {
+    const string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) {
+        fprintf(stderr, "Only http:// URLs are supported\n");
+        return false;
+    }
+    string rest = url.substr(scheme.size());
+    size_t slash = rest.find('/');
+    string hostport = rest.substr(0, slash);
+    path = slash == string::npos ? "/" : rest.substr(slash);
+    size_t colon = hostport.rfind(':');
+    if (colon != string::npos) {
+        opt.host = hostport.substr(0, colon);
+        opt.port = hostport.substr(colon + 1);
+    } else {
+        opt.host = hostport;
+    }
+    return !opt.host.empty();
+}
+
+static void LoadTargets(const string &file, vector<Target> &targets) {
+    istringstream in(ReadFile(file));
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        istringstream ls(line);
+        Target t;
+        string first;
+        ls >> first;
+        if (first[0] == '/') {
+            t.method = "GET";
+            t.path = first;
+        } else {
+            t.method = first;
+            ls >> t.path;
+        }
+        string body;
+        getline(ls >> ws, body);
+        t.body = BodyArg(body);
+        targets.push_back(t);
+    }
+}
+
+static void Report(const Options &opt, const Stats &s, double secs) {
+    const Histogram &h = s.latency;
+    if (opt.json) {
+        printf("{\"threads\":%d,\"connections\":%d,\"pipeline\":%d,"
+               "\"keepalive\":%s,\"rate\":%.1f,\"duration\":%.3f,"
+               "\"requests\":%lu,\"responses\":%lu,\"rps\":%.1f,"
+               "\"bytes_in\":%lu,\"bytes_out\":%lu,"
+               "\"status\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,"
+               "\"5xx\":%lu,\"other\":%lu},"
+               "\"errors\":{\"connect\":%lu,\"read\":%lu,\"write\":%lu,"
+               "\"lost\":%lu},\"connects\":%lu,\"backlog_max\":%lu,"
+               "\"latency_us\":{\"min\":%lu,\"mean\":%.1f,\"p50\":%lu,"
+               "\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+               opt.threads, opt.connections, opt.pipeline,
+               opt.keepAlive ? "true" : "false", opt.rate, secs, s.requests,
+               s.responses, s.responses / secs, s.bytesIn, s.bytesOut,
+               s.status[1], s.status[2], s.status[3], s.status[4], s.status[5],
+               s.status[0], s.connectErrors, s.readErrors, s.writeErrors,
+               s.lost, s.connects, s.backlogMax, h.Min(), h.Mean(),
+               h.Percentile(50), h.Percentile(90), h.Percentile(99),
+               h.Percentile(99.9), h.Max());
+        return;
+    }
+    printf("\n%d threads, %d connections, pipeline %d, %s, %s\n", opt.threads,
+           opt.connections, opt.pipeline,
+           opt.keepAlive ? "keep-alive" : "close",
+           opt.rate > 0 ? ("open loop " + to_string(int(opt.rate)) + " req/s")
+                              .c_str()
+                        : "closed loop");
+    printf("Requests: %lu, responses: %lu in %.2fs, %lu connects\n",
+           s.requests, s.responses, secs, s.connects);
+    printf("Throughput: %.1f req/s, %.2f MB/s in, %.2f MB/s out\n",
+           s.responses / secs, s.bytesIn / secs / 1048576.0,
+           s.bytesOut / secs / 1048576.0);
+    printf("Status: 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu other=%lu\n", s.status[2],
+           s.status[3], s.status[4], s.status[5], s.status[0] + s.status[1]);
+    printf("Errors: connect=%lu read=%lu write=%lu lost=%lu\n",
+           s.connectErrors, s.readErrors, s.writeErrors, s.lost);
+    if (opt.rate > 0) {
+        printf("Max backlog: %lu requests\n", s.backlogMax);
+    }
+    printf("Latency (us): min=%lu mean=%.1f p50=%lu p90=%lu p99=%lu "
+           "p999=%lu max=%lu\n", h.Min(), h.Mean(), h.Percentile(50),
+           h.Percentile(90), h.Percentile(99), h.Percentile(99.9), h.Max());
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"threads", required_argument, nullptr, 't'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"pipeline", required_argument, nullptr, 'p'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"close", no_argument, nullptr, 'C'},
+        {"method", required_argument, nullptr, 'm'},
+        {"body", required_argument, nullptr, 'b'},
+        {"header", required_argument, nullptr, 'H'},
+        {"urls", required_argument, nullptr, 'u'},
+        {"json", no_argument, nullptr, 'j'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+
+    Options opt;
+    string method, body, urlFile;
+    int c;
+    while ((c = getopt_long(argc, argv, "t:c:d:p:r:Cm:b:H:u:jh?",
+                            long_options, nullptr)) != EOF) {
+        switch (c) {
+            case 't': opt.threads = atoi(optarg); break;
+            case 'c': opt.connections = atoi(optarg); break;
+            case 'd': opt.duration = atoi(optarg); break;
+            case 'p': opt.pipeline = atoi(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 'C': opt.keepAlive = false; break;
+            case 'm': method = optarg; break;
+            case 'b': body = BodyArg(optarg); break;
+            case 'H': opt.headers.push_back(optarg); break;
+            case 'u': urlFile = optarg; break;
+            case 'j': opt.json = true; break;
+            default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 2;
+    }
+    string path;
+    if (!ParseUrl(argv[optind], opt, path)) {
+        return 2;
+    }
+    if (opt.threads < 1 || opt.connections < opt.threads ||
+        opt.duration < 1 || opt.pipeline < 1 || opt.rate < 0) {
+        fprintf(stderr, "Need threads >= 1, connections >= threads, "
+                        "duration >= 1, pipeline >= 1, rate >= 0\n");
+        return 2;
+    }
+    if (!urlFile.empty()) {
+        LoadTargets(urlFile, opt.targets);
+    }
+    if (opt.targets.empty()) {
+        Target t;
+        t.method = !method.empty() ? method : body.empty() ? "GET" : "POST";
+        t.path = path;
+        t.body = body;
+        opt.targets.push_back(t);
+    }
+    for (Target &t : opt.targets) {
+        BuildRequest(opt, t);
+    }
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res) != 0 ||
+        !res) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", opt.host.c_str(),
+                opt.port.c_str());
+        return 2;
+    }
+    sockaddr_storage addr{};
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    socklen_t addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    vector<unique_ptr<Worker>> workers;
+    for (int i = 0; i < opt.threads; i++) {
+        int conns = opt.connections / opt.threads +
+                    (i < opt.connections % opt.threads ? 1 : 0);
+        workers.emplace_back(new Worker(opt, addr, addrLen, conns,
+                                        opt.rate / opt.threads, i));
+    }
+    if (!opt.json) {
+        printf("httpbench %s %s:%s for %ds, %zu target(s)\n",
+               opt.targets[0].method.c_str(), opt.host.c_str(),
+               opt.port.c_str(), opt.duration, opt.targets.size());
+    }
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::seconds(opt.duration);
+    vector<thread> threads;
+    for (auto &w : workers) {
+        threads.emplace_back([&w, start, end] { w->Run(start, end); });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double secs = chrono::duration<double>(Clock::now() - start).count();
+
+    Stats total;
+    for (auto &w : workers) {
+        total.Merge(w->GetStats());
+    }
+    Report(opt, total, secs);
+    return total.responses ? 0 : 1;
+}